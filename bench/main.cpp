@@ -0,0 +1,264 @@
+/*****************************************************************************
+ *
+ * Decoder micro-benchmarks for the mssql plugin.
+ *
+ * Decodes every blob of the corpus (see bench/make_corpus.py) with each of the
+ * decoders mssql_featureset can use and reports time per vertex, heap
+ * allocations per feature and input throughput.
+ *
+ * usage: ./bench/run [corpus_dir] [min_seconds_per_case]
+ *
+ *****************************************************************************/
+
+#include "../mssql/geoclr_reader.hpp"
+#include "../mssql/mssqlclrgeo.hpp"
+
+// mapnik
+#include <mapnik/geometry.hpp>
+#include <mapnik/wkb.hpp>
+
+// stl
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::atomic<std::size_t> allocations(0);
+
+}
+
+void* operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete[](void* p) noexcept
+{
+    operator delete(p);
+}
+
+namespace {
+
+struct corpus_entry
+{
+    std::string name;
+    bool is_geography;
+    std::vector<char> clr;
+    std::vector<char> wkb;
+};
+
+struct vertex_count
+{
+    std::size_t operator()(mapnik::geometry::geometry_empty const&) const
+    {
+        return 0;
+    }
+
+    std::size_t operator()(mapnik::geometry::point<double> const&) const
+    {
+        return 1;
+    }
+
+    std::size_t operator()(mapnik::geometry::line_string<double> const& line) const
+    {
+        return line.size();
+    }
+
+    std::size_t operator()(mapnik::geometry::polygon<double> const& poly) const
+    {
+        std::size_t count = poly.exterior_ring.size();
+        for (auto const& ring : poly.interior_rings)
+        {
+            count += ring.size();
+        }
+        return count;
+    }
+
+    std::size_t operator()(mapnik::geometry::multi_point<double> const& multi_point) const
+    {
+        return multi_point.size();
+    }
+
+    std::size_t operator()(mapnik::geometry::multi_line_string<double> const& multi_line) const
+    {
+        std::size_t count = 0;
+        for (auto const& line : multi_line)
+        {
+            count += (*this)(line);
+        }
+        return count;
+    }
+
+    std::size_t operator()(mapnik::geometry::multi_polygon<double> const& multi_poly) const
+    {
+        std::size_t count = 0;
+        for (auto const& poly : multi_poly)
+        {
+            count += (*this)(poly);
+        }
+        return count;
+    }
+
+    std::size_t operator()(mapnik::geometry::geometry_collection<double> const& collection) const
+    {
+        std::size_t count = 0;
+        for (auto const& geom : collection)
+        {
+            count += mapnik::util::apply_visitor(*this, geom);
+        }
+        return count;
+    }
+};
+
+std::size_t count_vertices(mapnik::geometry::geometry<double> const& geom)
+{
+    return mapnik::util::apply_visitor(vertex_count(), geom);
+}
+
+bool read_file(std::string const& path, std::vector<char>& data)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+std::vector<corpus_entry> load_corpus(std::string const& dir)
+{
+    std::vector<corpus_entry> corpus;
+    std::ifstream index((dir + "/index.txt").c_str());
+    if (!index)
+    {
+        std::cerr << "cannot open " << dir << "/index.txt, run bench/make_corpus.py" << std::endl;
+        std::exit(1);
+    }
+
+    std::string name, kind;
+    while (index >> name >> kind)
+    {
+        corpus_entry entry;
+        entry.name = name;
+        entry.is_geography = kind == "geography";
+        if (!read_file(dir + "/" + name + ".clr", entry.clr))
+        {
+            std::cerr << "missing " << name << ".clr" << std::endl;
+            std::exit(1);
+        }
+        read_file(dir + "/" + name + ".wkb", entry.wkb);
+        corpus.push_back(std::move(entry));
+    }
+    return corpus;
+}
+
+void run_case(std::string const& decoder, corpus_entry const& entry, std::size_t input_size,
+              std::size_t vertices, double min_seconds, std::function<void()> const& decode)
+{
+    using clock = std::chrono::steady_clock;
+
+    // warm up and calibrate the batch size to ~1/20 of the budget
+    std::size_t batch = 1;
+    for (;;)
+    {
+        auto start = clock::now();
+        for (std::size_t i = 0; i < batch; ++i)
+        {
+            decode();
+        }
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        if (elapsed > min_seconds / 20 || batch > (1u << 30))
+        {
+            break;
+        }
+        batch *= 2;
+    }
+
+    std::size_t iterations = 0;
+    std::size_t allocs_before = allocations.load();
+    auto start = clock::now();
+    double elapsed = 0;
+    while (elapsed < min_seconds)
+    {
+        for (std::size_t i = 0; i < batch; ++i)
+        {
+            decode();
+        }
+        iterations += batch;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    std::size_t allocs = allocations.load() - allocs_before;
+
+    double ns_per_feature = elapsed * 1e9 / iterations;
+    std::printf("%-26s %-14s %10zu %12.1f %10.2f %10.1f %10.1f\n",
+                entry.name.c_str(),
+                decoder.c_str(),
+                vertices,
+                ns_per_feature,
+                vertices ? ns_per_feature / vertices : 0.0,
+                double(allocs) / iterations,
+                input_size * iterations / elapsed / (1024 * 1024));
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    std::string dir = argc > 1 ? argv[1] : "bench/corpus";
+    double min_seconds = argc > 2 ? std::atof(argv[2]) : 0.5;
+
+    std::vector<corpus_entry> corpus = load_corpus(dir);
+
+    std::printf("%-26s %-14s %10s %12s %10s %10s %10s\n",
+                "case", "decoder", "vertices", "ns/feature", "ns/vertex", "allocs", "MB/s");
+
+    for (auto const& entry : corpus)
+    {
+        std::size_t vertices = count_vertices(from_geoclr(entry.clr.data(), entry.clr.size(), entry.is_geography));
+
+        run_case("parseGeometry", entry, entry.clr.size(), vertices, min_seconds, [&entry]() {
+            mssqlclr::sqlgeo_reader reader(entry.clr.data(), entry.clr.size());
+            volatile uint32_t num_points = reader.parseGeometry(entry.is_geography).NumPoints;
+            (void)num_points;
+        });
+
+        run_case("from_geoclr", entry, entry.clr.size(), vertices, min_seconds, [&entry]() {
+            mapnik::geometry::geometry<double> geom = from_geoclr(entry.clr.data(), entry.clr.size(), entry.is_geography);
+        });
+
+        if (!entry.wkb.empty())
+        {
+            std::size_t wkb_vertices = count_vertices(mapnik::geometry_utils::from_wkb(entry.wkb.data(), entry.wkb.size()));
+            run_case("from_wkb", entry, entry.wkb.size(), wkb_vertices, min_seconds, [&entry]() {
+                mapnik::geometry::geometry<double> geom = mapnik::geometry_utils::from_wkb(entry.wkb.data(), entry.wkb.size());
+            });
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,184 @@
+#!/usr/bin/env python
+"""
+Writes the decoder benchmark corpus to bench/corpus.
+
+Every entry is serialized in the SQL Server CLR format (MS-SSCLRT, version 1,
+or version 2 when it holds circular arcs) as returned by a geometry/geography
+column, together with the WKB that .STAsBinary() returns for the same value.
+Coordinates come from a fixed seed so the corpus is reproducible.
+"""
+
+import math
+import os
+import random
+import struct
+
+OUT = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'corpus')
+
+POINT, LINESTRING, POLYGON, MULTIPOINT, MULTILINESTRING, MULTIPOLYGON, COLLECTION = range(1, 8)
+CIRCULARSTRING, COMPOUNDCURVE, CURVEPOLYGON = 8, 9, 10
+
+FIG_INTERIOR, FIG_STROKE, FIG_EXTERIOR = 0, 1, 2
+FIG_V2_LINE, FIG_V2_ARC, FIG_V2_COMPOSITE = 1, 2, 3
+SEG_LINE, SEG_ARC, SEG_FIRST_LINE, SEG_FIRST_ARC = 0, 1, 2, 3
+
+FLAG_VALID, FLAG_SINGLE_POINT, FLAG_SINGLE_LINE = 0x04, 0x08, 0x10
+
+
+class Clr(object):
+    """Accumulates points, figures and shapes in the serialized (pre-order) layout."""
+
+    def __init__(self, version=1):
+        self.version = version
+        self.points = []
+        self.figures = []
+        self.shapes = []
+        self.segments = []
+
+    def shape(self, parent, kind):
+        self.shapes.append((parent, len(self.figures), kind))
+        return len(self.shapes) - 1
+
+    def figure(self, attribute, coords):
+        self.figures.append((attribute, len(self.points)))
+        self.points.extend(coords)
+
+    def serialize(self, srid, geography=False):
+        flags = FLAG_VALID
+        single = None
+        if self.version == 1 and len(self.shapes) == 1 and len(self.figures) == 1:
+            if self.shapes[0][2] == POINT and len(self.points) == 1:
+                single = FLAG_SINGLE_POINT
+            elif self.shapes[0][2] == LINESTRING and len(self.points) == 2:
+                single = FLAG_SINGLE_LINE
+        b = struct.pack('<iBB', srid, self.version, flags | (single or 0))
+        if single is None:
+            b += struct.pack('<I', len(self.points))
+        for x, y in self.points:
+            b += struct.pack('<dd', *((y, x) if geography else (x, y)))
+        if single is None:
+            b += struct.pack('<I', len(self.figures))
+            for attribute, offset in self.figures:
+                b += struct.pack('<BI', attribute, offset)
+            b += struct.pack('<I', len(self.shapes))
+            for parent, offset, kind in self.shapes:
+                b += struct.pack('<iiB', parent, offset, kind)
+        if self.version == 2:
+            b += struct.pack('<I', len(self.segments)) + bytes(bytearray(self.segments))
+        return b
+
+
+def wkb(geom):
+    kind, body = geom
+    b = struct.pack('<BI', 1, kind)
+    if kind == POINT:
+        return b + struct.pack('<dd', *body)
+    if kind == LINESTRING:
+        return b + struct.pack('<I', len(body)) + b''.join(struct.pack('<dd', *p) for p in body)
+    if kind == POLYGON:
+        b += struct.pack('<I', len(body))
+        for ring in body:
+            b += struct.pack('<I', len(ring)) + b''.join(struct.pack('<dd', *p) for p in ring)
+        return b
+    return b + struct.pack('<I', len(body)) + b''.join(wkb(g) for g in body)
+
+
+def add_clr(clr, geom, parent=-1):
+    kind, body = geom
+    idx = clr.shape(parent, kind)
+    if kind == POINT:
+        clr.figure(FIG_STROKE, [body])
+    elif kind == LINESTRING:
+        clr.figure(FIG_STROKE, body)
+    elif kind == POLYGON:
+        for i, ring in enumerate(body):
+            clr.figure(FIG_EXTERIOR if i == 0 else FIG_INTERIOR, ring)
+    else:
+        for g in body:
+            add_clr(clr, g, idx)
+
+
+def ring(rnd, cx, cy, radius, count, jitter, clockwise=False):
+    coords = []
+    for i in range(count):
+        a = 2.0 * math.pi * i / count
+        if clockwise:
+            a = -a
+        r = radius * (1.0 + jitter * (rnd.random() - 0.5))
+        coords.append((cx + r * math.cos(a), cy + r * math.sin(a)))
+    coords.append(coords[0])
+    return coords
+
+
+def walk(rnd, x, y, step, count):
+    coords = []
+    for _ in range(count):
+        coords.append((x, y))
+        x += step * (rnd.random() - 0.3)
+        y += step * (rnd.random() - 0.5)
+    return coords
+
+
+def corpus():
+    rnd = random.Random(20161017)
+    entries = []
+
+    entries.append(('point', 'geometry', 0, (POINT, (-73.567, 45.508))))
+    entries.append(('point_geography', 'geography', 4326, (POINT, (-73.567, 45.508))))
+    entries.append(('linestring_1k', 'geometry', 3857,
+                    (LINESTRING, walk(rnd, -8190000.0, 5700000.0, 25.0, 1000))))
+    entries.append(('linestring_geography_20k', 'geography', 4326,
+                    (LINESTRING, walk(rnd, -80.0, 40.0, 0.0005, 20000))))
+
+    holes = [ring(rnd, 300000.0 * math.cos(i), 300000.0 * math.sin(i), 20000.0, 100, 0.2, True)
+             for i in range(20)]
+    entries.append(('polygon_huge', 'geometry', 3857,
+                    (POLYGON, [ring(rnd, 0.0, 0.0, 1000000.0, 12000, 0.05)] + holes)))
+
+    parts = [(POLYGON, [ring(rnd, (i % 25) * 2.0, (i // 25) * 2.0, 0.8, 24, 0.3)]) for i in range(500)]
+    entries.append(('multipolygon_500_parts', 'geometry', 4326, (MULTIPOLYGON, parts)))
+
+    members = []
+    for i in range(100):
+        pick = i % 3
+        if pick == 0:
+            members.append((POINT, (rnd.uniform(0, 100), rnd.uniform(0, 100))))
+        elif pick == 1:
+            members.append((LINESTRING, walk(rnd, rnd.uniform(0, 100), rnd.uniform(0, 100), 0.5, 50)))
+        else:
+            members.append((POLYGON, [ring(rnd, rnd.uniform(0, 100), rnd.uniform(0, 100), 1.0, 50, 0.2)]))
+    entries.append(('collection_100', 'geometry', 0, (COLLECTION, members)))
+
+    for name, kind, srid, geom in entries:
+        clr = Clr()
+        add_clr(clr, geom)
+        yield name, kind, clr.serialize(srid, kind == 'geography'), wkb(geom)
+
+    # version 2 curves, SQL Server has no WKB for them
+    arc = Clr(version=2)
+    arc.shape(-1, CIRCULARSTRING)
+    arc.figure(FIG_V2_ARC, [(0.0, 0.0), (1.0, 1.0), (2.0, 0.0), (3.0, -1.0), (4.0, 0.0)])
+    yield 'circularstring_v2', 'geometry', arc.serialize(0), None
+
+    compound = Clr(version=2)
+    compound.shape(-1, CURVEPOLYGON)
+    compound.figure(FIG_V2_COMPOSITE, [(0.0, 0.0), (10.0, 0.0), (10.0, 10.0), (5.0, 15.0), (0.0, 10.0), (0.0, 0.0)])
+    compound.segments = [SEG_FIRST_LINE, SEG_LINE, SEG_ARC, SEG_LINE]
+    yield 'curvepolygon_v2', 'geometry', compound.serialize(0), None
+
+
+def main():
+    if not os.path.isdir(OUT):
+        os.makedirs(OUT)
+    with open(os.path.join(OUT, 'index.txt'), 'w') as index:
+        for name, kind, clr, wkb_data in corpus():
+            with open(os.path.join(OUT, name + '.clr'), 'wb') as f:
+                f.write(clr)
+            if wkb_data is not None:
+                with open(os.path.join(OUT, name + '.wkb'), 'wb') as f:
+                    f.write(wkb_data)
+            index.write('%s %s\n' % (name, kind))
+
+
+if __name__ == '__main__':
+    main()
@@ -29,6 +29,7 @@
 #include "connection_manager.hpp"
 #include "resultset.hpp"
 #include <memory>
+#include <mutex>
 #include <queue>
 
 class mssql_processor_context;
@@ -38,13 +39,19 @@ class AsyncResultSet : public IResultSet, private mapnik::util::noncopyable
 {
   public:
     AsyncResultSet(mssql_processor_context_ptr const& ctx,
-                   std::shared_ptr<Pool<Connection, ConnectionCreator>> const& pool,
-                   std::shared_ptr<Connection> const& conn, std::string const& sql)
+                   std::shared_ptr<ConnectionPool<Connection, ConnectionCreator>> const& pool,
+                   std::shared_ptr<Connection> const& conn, std::string const& sql,
+                   sql_parameters const& params = sql_parameters(),
+                   std::size_t block_size = 0,
+                   std::shared_ptr<io_thread_pool> const& io = std::shared_ptr<io_thread_pool>())
         : ctx_(ctx),
           pool_(pool),
           conn_(conn),
           sql_(sql),
-          is_closed_(false)
+          params_(params),
+          is_closed_(false),
+          block_size_(block_size),
+          io_(io)
     {
     }
 
@@ -63,9 +70,9 @@ class AsyncResultSet : public IResultSet, private mapnik::util::noncopyable
         if (conn_ && conn_->isPending())
         {
             MAPNIK_LOG_DEBUG(mssql) << "AsyncResultSet: aborting pending connection - " << conn_.get();
-            // there is no easy way to abort a pending connection, so we close it : this will ensure that
-            // the connection will be recycled in the pool
-            conn_->close();
+            // the query is cancelled, the connection stays open and goes
+            // back to the pool
+            conn_->cancel();
         }
     }
 
@@ -73,7 +80,11 @@ class AsyncResultSet : public IResultSet, private mapnik::util::noncopyable
     {
         if (!is_closed_)
         {
-            rs_.reset();
+            if (rs_)
+            {
+                rs_->cancel();
+                rs_.reset();
+            }
             is_closed_ = true;
             if (conn_)
             {
@@ -99,7 +110,7 @@ class AsyncResultSet : public IResultSet, private mapnik::util::noncopyable
             // Ensure connection is valid
             if (conn_ && conn_->isOK())
             {
-                rs_ = conn_->getAsyncResult();
+                rs_ = conn_->getAsyncResult(block_size_);
             }
             else
             {
@@ -177,20 +188,33 @@ class AsyncResultSet : public IResultSet, private mapnik::util::noncopyable
         return rs_->getBinary(index);
     }
 
+    virtual binary_view getBinaryView(int index) const
+    {
+        return rs_->getBinaryView(index);
+    }
+
+    virtual binary_view getUtf16View(int index) const
+    {
+        return rs_->getUtf16View(index);
+    }
+
   private:
     mssql_processor_context_ptr ctx_;
-    std::shared_ptr<Pool<Connection, ConnectionCreator>> pool_;
+    std::shared_ptr<ConnectionPool<Connection, ConnectionCreator>> pool_;
     std::shared_ptr<Connection> conn_;
     std::string sql_;
+    sql_parameters params_;
     std::shared_ptr<ResultSet> rs_;
     bool is_closed_;
+    std::size_t block_size_;
+    std::shared_ptr<io_thread_pool> io_;
 
     void prepare()
     {
         conn_ = pool_->borrowObject();
         if (conn_ && conn_->isOK())
         {
-            conn_->executeAsyncQuery(sql_);
+            conn_->executeAsyncQuery(sql_, params_, io_.get());
         }
         else
         {
@@ -208,13 +232,16 @@ class mssql_processor_context : public mapnik::IProcessorContext
         : num_async_requests_(0) {}
     ~mssql_processor_context() {}
 
+    // the pipelined featureset moves to the next request from its fetch thread
     void add_request(std::shared_ptr<AsyncResultSet> const& req)
     {
+        std::lock_guard<std::mutex> lock(mutex_);
         q_.push(req);
     }
 
     std::shared_ptr<AsyncResultSet> pop_next_request()
     {
+        std::lock_guard<std::mutex> lock(mutex_);
         std::shared_ptr<AsyncResultSet> r;
         if (!q_.empty())
         {
@@ -229,6 +256,7 @@ class mssql_processor_context : public mapnik::IProcessorContext
   private:
     using async_queue = std::queue<std::shared_ptr<AsyncResultSet>>;
     async_queue q_;
+    std::mutex mutex_;
 };
 
 inline void AsyncResultSet::prepare_next()
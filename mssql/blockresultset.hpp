@@ -0,0 +1,230 @@
+#ifndef MSSQL_BLOCKRESULTSET_HPP
+#define MSSQL_BLOCKRESULTSET_HPP
+
+#include <mapnik/debug.hpp>
+
+#include "resultset.hpp"
+#include "row_snapshot.hpp"
+
+#include <sqlext.h>
+
+#include <memory>
+#include <vector>
+
+// Result set fetching block_size rows per SQLFetch. The numeric columns at
+// the start of the select list are bound to column-wise arrays and served
+// from them; the geometry and the columns after it are still read with
+// SQLGetData, on the row selected by SQLSetPos. Binding only the leading
+// columns keeps every SQLGetData after the bound ones, which is all drivers
+// without SQL_GD_ANY_COLUMN (SQL Server's) allow. Needs SQL_GD_BLOCK when
+// block_size > 1.
+class BlockResultSet : public ResultSet
+{
+  public:
+    BlockResultSet(SQLHANDLE res, std::size_t block_size, bool keep_handle = false)
+        : ResultSet(res, keep_handle),
+          block_size_(block_size > 0 ? block_size : 1),
+          row_status_(block_size_),
+          rows_fetched_(0),
+          row_(0)
+    {
+    }
+
+    virtual ~BlockResultSet()
+    {
+        close();
+    }
+
+    virtual void close()
+    {
+        bool unbind = !is_closed_ && keep_handle_ && schema_;
+        ResultSet::close();
+        if (unbind)
+        {
+            // the statement is executed again, it must not point to our arrays
+            SQLFreeStmt(res_, SQL_UNBIND);
+            SQLSetStmtAttr(res_, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER)1, 0);
+            SQLSetStmtAttr(res_, SQL_ATTR_ROW_STATUS_PTR, NULL, 0);
+            SQLSetStmtAttr(res_, SQL_ATTR_ROWS_FETCHED_PTR, NULL, 0);
+        }
+    }
+
+    virtual bool next()
+    {
+        if (!schema_)
+        {
+            bind();
+        }
+
+        // next row of the current block
+        while (++row_ < rows_fetched_)
+        {
+            if (row_status_[row_] == SQL_ROW_NOROW)
+            {
+                continue;
+            }
+            if (row_status_[row_] == SQL_ROW_ERROR)
+            {
+                throw mapnik::datasource_exception("resultset next error: " + getOdbcError(SQL_HANDLE_STMT, res_));
+            }
+            SQLRETURN retcode = SQLSetPos(res_, SQLSETPOSIROW(row_ + 1), SQL_POSITION, SQL_LOCK_NO_CHANGE);
+            if (!(retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO))
+            {
+                throw mapnik::datasource_exception("resultset next error: " + getOdbcError(SQL_HANDLE_STMT, res_));
+            }
+            return true;
+        }
+
+        // next block, the cursor is on its first row
+        rows_fetched_ = 0;
+        row_ = 0;
+        if (!ResultSet::next() || rows_fetched_ == 0)
+        {
+            return false;
+        }
+        if (row_status_[0] == SQL_ROW_ERROR)
+        {
+            throw mapnik::datasource_exception("resultset next error: " + getOdbcError(SQL_HANDLE_STMT, res_));
+        }
+        return row_status_[0] != SQL_ROW_NOROW || next();
+    }
+
+    virtual const std::string getFieldName(int index) const
+    {
+        return schema_ ? schema_->names[index] : ResultSet::getFieldName(index);
+    }
+
+    virtual int getTypeOID(int index) const
+    {
+        return schema_ ? schema_->types[index] : ResultSet::getTypeOID(index);
+    }
+
+    virtual const boost::optional<int> getInt(int index) const
+    {
+        bound_column const* column = bound(index);
+        if (!column)
+        {
+            return ResultSet::getInt(index);
+        }
+        if (column->indicators[row_] == SQL_NULL_DATA)
+        {
+            return boost::optional<int>();
+        }
+        return column->c_type == SQL_C_SBIGINT ? int(column->integers[row_]) : int(column->reals[row_]);
+    }
+
+    virtual const boost::optional<long long> getBigInt(int index) const
+    {
+        bound_column const* column = bound(index);
+        if (!column)
+        {
+            return ResultSet::getBigInt(index);
+        }
+        if (column->indicators[row_] == SQL_NULL_DATA)
+        {
+            return boost::optional<long long>();
+        }
+        return column->c_type == SQL_C_SBIGINT ? column->integers[row_] : (long long)(column->reals[row_]);
+    }
+
+    virtual const boost::optional<double> getDouble(int index) const
+    {
+        bound_column const* column = bound(index);
+        if (!column)
+        {
+            return ResultSet::getDouble(index);
+        }
+        if (column->indicators[row_] == SQL_NULL_DATA)
+        {
+            return boost::optional<double>();
+        }
+        return column->c_type == SQL_C_SBIGINT ? double(column->integers[row_]) : column->reals[row_];
+    }
+
+    virtual const boost::optional<float> getFloat(int index) const
+    {
+        bound_column const* column = bound(index);
+        if (!column)
+        {
+            return ResultSet::getFloat(index);
+        }
+        if (column->indicators[row_] == SQL_NULL_DATA)
+        {
+            return boost::optional<float>();
+        }
+        return column->c_type == SQL_C_SBIGINT ? float(column->integers[row_]) : float(column->reals[row_]);
+    }
+
+  private:
+    struct bound_column
+    {
+        SQLSMALLINT c_type;
+        std::vector<SQLBIGINT> integers;
+        std::vector<SQLDOUBLE> reals;
+        std::vector<SQLLEN> indicators;
+    };
+
+    bound_column const* bound(int index) const
+    {
+        return schema_ && columns_[index] ? columns_[index].get() : nullptr;
+    }
+
+    // binds the numeric columns up to the first other one, the geometry is
+    // never bound
+    void bind()
+    {
+        schema_ = std::make_shared<row_schema>(*this);
+        std::size_t count = schema_->types.size();
+        columns_.resize(count);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            row_schema::kind kind = row_schema::kind_of(schema_->types[i]);
+            if (kind != row_schema::INTEGER && kind != row_schema::REAL)
+            {
+                break;
+            }
+
+            std::unique_ptr<bound_column> column(new bound_column);
+            column->indicators.resize(block_size_);
+            SQLPOINTER buffer;
+            SQLLEN buffer_length;
+            if (kind == row_schema::INTEGER)
+            {
+                column->c_type = SQL_C_SBIGINT;
+                column->integers.resize(block_size_);
+                buffer = column->integers.data();
+                buffer_length = sizeof(SQLBIGINT);
+            }
+            else
+            {
+                column->c_type = SQL_C_DOUBLE;
+                column->reals.resize(block_size_);
+                buffer = column->reals.data();
+                buffer_length = sizeof(SQLDOUBLE);
+            }
+
+            SQLRETURN retcode = SQLBindCol(res_, SQLUSMALLINT(i + 1), column->c_type, buffer, buffer_length, column->indicators.data());
+            if (!(retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO))
+            {
+                throw mapnik::datasource_exception("Mssql Plugin: SQLBindCol error: " + getOdbcError(SQL_HANDLE_STMT, res_));
+            }
+            columns_[i] = std::move(column);
+        }
+
+        if (SQLSetStmtAttr(res_, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER)block_size_, 0) < 0 ||
+            SQLSetStmtAttr(res_, SQL_ATTR_ROW_STATUS_PTR, row_status_.data(), 0) < 0 ||
+            SQLSetStmtAttr(res_, SQL_ATTR_ROWS_FETCHED_PTR, &rows_fetched_, 0) < 0)
+        {
+            throw mapnik::datasource_exception("Mssql Plugin: cannot set the row array size: " + getOdbcError(SQL_HANDLE_STMT, res_));
+        }
+    }
+
+    const std::size_t block_size_;
+    std::shared_ptr<const row_schema> schema_;
+    std::vector<std::unique_ptr<bound_column>> columns_;
+    std::vector<SQLUSMALLINT> row_status_;
+    SQLULEN rows_fetched_;
+    SQLULEN row_;
+};
+
+#endif // MSSQL_BLOCKRESULTSET_HPP
@@ -29,7 +29,10 @@
 #include <mapnik/timer.hpp>
 
 // std
+#include <algorithm>
+#include <future>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <sstream>
 #include <thread>
@@ -39,14 +42,19 @@
 #include <sqlext.h>
 #include <sqlucode.h>
 
+#include "blockresultset.hpp"
+#include "io_thread_pool.hpp"
 #include "resultset.hpp"
+#include "sql_parameters.hpp"
 
 class Connection
 {
   public:
     Connection(SQLHANDLE sqlenvhandle, std::string const& connection_str, boost::optional<std::string> const& password)
         : closed_(false),
-          pending_(false)
+          pending_(false),
+          async_prepared_(false),
+          getdata_extensions_(-1)
     {
         SQLRETURN retcode;
 
@@ -90,7 +98,8 @@ class Connection
     {
         if (!closed_)
         {
-
+            cancelAsyncExecution();
+            freePreparedStatements();
             SQLRETURN retcode = SQLDisconnect(sqlconnectionhandle);
             SQLFreeHandle(SQL_HANDLE_DBC, sqlconnectionhandle);
 
@@ -119,7 +128,9 @@ class Connection
         return retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO;
     }
 
-    std::shared_ptr<ResultSet> executeQuery(std::string const& sql)
+    // block_size > 1 fetches that many rows per round trip, see BlockResultSet.
+    // A statement with parameters is prepared once and kept by the connection.
+    std::shared_ptr<ResultSet> executeQuery(std::string const& sql, sql_parameters const& params = sql_parameters(), std::size_t block_size = 0)
     {
 #ifdef MAPNIK_STATS
         mapnik::progress_timer __stats__(std::clog, std::string("mssql_connection::execute_query ") + sql);
@@ -128,11 +139,20 @@ class Connection
         SQLHANDLE hstmt = NULL;
         SQLRETURN retcode;
 
-        if (SQL_SUCCESS != SQLAllocHandle(SQL_HANDLE_STMT, sqlconnectionhandle, &hstmt))
+        prepared_statement* prepared = params.empty() ? nullptr : prepare(sql, params);
+        if (prepared)
         {
-            throw mapnik::datasource_exception("SQLAllocHandle error");
+            hstmt = prepared->hstmt;
+            retcode = SQLExecute(hstmt);
+        }
+        else
+        {
+            if (SQL_SUCCESS != SQLAllocHandle(SQL_HANDLE_STMT, sqlconnectionhandle, &hstmt))
+            {
+                throw mapnik::datasource_exception("SQLAllocHandle error");
+            }
+            retcode = SQLExecDirectA(hstmt, (SQLCHAR*)sql.c_str(), SQL_NTS);
         }
-        retcode = SQLExecDirectA(hstmt, (SQLCHAR*)sql.c_str(), SQL_NTS);
 
         if (!(retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO))
         {
@@ -141,29 +161,55 @@ class Connection
             err_msg += sql;
             err_msg += "'\n";
 
-            SQLFreeHandle(SQL_HANDLE_STMT, hstmt);
+            freeStatement(hstmt);
             throw mapnik::datasource_exception(err_msg);
         }
 
-        return std::make_shared<ResultSet>(hstmt);
+        return makeResultSet(hstmt, block_size, prepared != nullptr);
     }
 
-    bool executeAsyncQuery(std::string const& sql)
+    // with io, the statement is executed on one of its threads and
+    // getResult() waits for it; otherwise the driver async mode is used
+    bool executeAsyncQuery(std::string const& sql, sql_parameters const& params = sql_parameters(), io_thread_pool* io = nullptr)
     {
         debug_current_sql = sql;
         SQLRETURN retcode;
 
-        if (SQL_SUCCESS != SQLAllocHandle(SQL_HANDLE_STMT, sqlconnectionhandle, &async_hstmt))
+        prepared_statement* prepared = params.empty() ? nullptr : prepare(sql, params);
+        async_prepared_ = prepared != nullptr;
+        if (prepared)
+        {
+            async_hstmt = prepared->hstmt;
+        }
+        else if (SQL_SUCCESS != SQLAllocHandle(SQL_HANDLE_STMT, sqlconnectionhandle, &async_hstmt))
         {
             throw mapnik::datasource_exception("cant SQLAllocHandle");
         }
 
+        if (io)
+        {
+            SQLHANDLE hstmt = async_hstmt;
+            bool is_prepared = async_prepared_;
+            async_execution_ = io->submit([hstmt, is_prepared, sql]() {
+                return is_prepared ? SQLExecute(hstmt) : SQLExecDirectA(hstmt, (SQLCHAR*)sql.c_str(), SQL_NTS);
+            });
+            pending_ = true;
+            return 1;
+        }
+
 #ifdef _WIN32
         //freetds does not seem to support async
         retcode = SQLSetStmtAttr(async_hstmt, SQL_ATTR_ASYNC_ENABLE, (SQLPOINTER)SQL_ASYNC_ENABLE_ON, 0);
 #endif
 
-        retcode = SQLExecDirectA(async_hstmt, (SQLCHAR*)sql.c_str(), SQL_NTS);
+        if (prepared)
+        {
+            retcode = SQLExecute(async_hstmt);
+        }
+        else
+        {
+            retcode = SQLExecDirectA(async_hstmt, (SQLCHAR*)sql.c_str(), SQL_NTS);
+        }
 
         if (!(retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO || retcode == SQL_STILL_EXECUTING))
         {
@@ -173,7 +219,7 @@ class Connection
             err_msg += sql;
             err_msg += "'\n";
             clearAsyncResult(async_hstmt);
-            close();
+            closeIfDead();
             throw mapnik::datasource_exception(err_msg);
         }
         pending_ = true;
@@ -182,6 +228,10 @@ class Connection
 
     SQLRETURN getResult()
     {
+        if (async_execution_.valid())
+        {
+            return async_execution_.get();
+        }
 #ifndef _WIN32
         //freetds does not seem to support async
         return SQL_SUCCESS;
@@ -191,7 +241,14 @@ class Connection
         while (true)
         {
 
-            retcode = SQLExecDirectA(async_hstmt, (SQLCHAR*)"", SQL_NTS);
+            if (async_prepared_)
+            {
+                retcode = SQLExecute(async_hstmt);
+            }
+            else
+            {
+                retcode = SQLExecDirectA(async_hstmt, (SQLCHAR*)"", SQL_NTS);
+            }
 
             if (retcode != SQL_STILL_EXECUTING)
             {
@@ -215,14 +272,16 @@ class Connection
             err_msg += err_status + "\n in getNextAsyncResult";
             clearAsyncResult(async_hstmt);
             // We need to guarde against losing the connection
-            // (i.e db restart) so here we invalidate the full connection
-            close();
+            // (i.e db restart)
+            closeIfDead();
             throw mapnik::datasource_exception(err_msg);
         }
-        return std::make_shared<ResultSet>(async_hstmt);
+        // the result set owns the statement now
+        pending_ = false;
+        return std::make_shared<ResultSet>(async_hstmt, async_prepared_);
     }
 
-    std::shared_ptr<ResultSet> getAsyncResult()
+    std::shared_ptr<ResultSet> getAsyncResult(std::size_t block_size = 0)
     {
 
         SQLRETURN result = getResult();
@@ -239,30 +298,51 @@ class Connection
             err_msg += err_msg + "\n query: " + debug_current_sql;
             clearAsyncResult(async_hstmt);
             // We need to be guarded against losing the connection
-            // (i.e db restart), we invalidate the full connection
-            close();
+            // (i.e db restart)
+            closeIfDead();
             throw mapnik::datasource_exception(err_msg);
         }
-        return std::make_shared<ResultSet>(async_hstmt);
+        // the result set owns the statement now
+        pending_ = false;
+        return makeResultSet(async_hstmt, block_size, async_prepared_);
     }
 
+    // SQL_ATTR_CONNECTION_DEAD is answered by the driver without a round
+    // trip; a driver that does not know it leaves the connection usable
     bool isOK() const
     {
         if (closed_)
         {
             return false;
         }
-        return true;
 
-        SQLINTEGER dead;
+        SQLUINTEGER dead = SQL_CD_FALSE;
 
         //SQLRETURN retcode = SQLGetConnectAttr(sqlconnectionhandle, SQL_COPT_SS_CONNECTION_DEAD, &dead, SQL_IS_UINTEGER, NULL);
         SQLRETURN retcode = SQLGetConnectAttr(sqlconnectionhandle, SQL_ATTR_CONNECTION_DEAD, &dead, 0, NULL);
         if (retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO)
         {
-            return (!closed_) && (dead != SQL_CD_TRUE);
+            return dead != SQL_CD_TRUE;
         }
         else
+        {
+            return true;
+        }
+    }
+
+    // a round trip to the server, for a connection idle long enough for its
+    // socket to be gone without the driver knowing
+    bool ping()
+    {
+        if (closed_ || pending_)
+        {
+            return false;
+        }
+        try
+        {
+            return execute("SELECT 1");
+        }
+        catch (mapnik::datasource_exception const&)
         {
             return false;
         }
@@ -273,10 +353,38 @@ class Connection
         return pending_;
     }
 
+    // stops the asynchronous query whose result was not taken and frees its
+    // statement, the session stays open for the next borrower
+    void cancel()
+    {
+        if (async_execution_.valid())
+        {
+            cancelAsyncExecution();
+        }
+        else if (pending_)
+        {
+            SQLCancel(async_hstmt);
+            clearAsyncResult(async_hstmt);
+        }
+        closeIfDead();
+    }
+
+    // a failed statement leaves the session usable, unless the driver
+    // reports it lost
+    void closeIfDead()
+    {
+        if (!isOK())
+        {
+            close();
+        }
+    }
+
     void close()
     {
         if (!closed_)
         {
+            cancelAsyncExecution();
+            freePreparedStatements();
             SQLRETURN retcode = SQLDisconnect(sqlconnectionhandle);
             SQLFreeHandle(SQL_HANDLE_DBC, sqlconnectionhandle);
             //SQLFreeHandle(SQL_HANDLE_ENV, sqlenvhandle);
@@ -288,18 +396,130 @@ class Connection
     }
 
   private:
+    // statements with parameters, by sql text, most recently used first
+    struct prepared_statement
+    {
+        std::string sql;
+        SQLHANDLE hstmt;
+        sql_parameters params;
+    };
+    static const std::size_t max_prepared_statements = 32;
+
     //SQLHANDLE sqlenvhandle;
     SQLHANDLE sqlconnectionhandle;
     SQLHANDLE async_hstmt;
 
     bool closed_;
     bool pending_;
+    bool async_prepared_;
 
     std::string debug_current_sql;
+    long getdata_extensions_;
+    std::list<prepared_statement> prepared_;
+    std::future<SQLRETURN> async_execution_;
 
-    void clearAsyncResult(SQLHANDLE hstmt)
+    // the handles must not be freed under a running execution
+    void cancelAsyncExecution()
+    {
+        if (async_execution_.valid())
+        {
+            SQLCancel(async_hstmt);
+            async_execution_.wait();
+            async_execution_ = std::future<SQLRETURN>();
+            clearAsyncResult(async_hstmt);
+        }
+    }
+
+    // the statement is prepared on first use, params stay alive with it
+    // until the next execution
+    prepared_statement* prepare(std::string const& sql, sql_parameters const& params)
+    {
+        auto itr = std::find_if(prepared_.begin(), prepared_.end(),
+                                [&sql](prepared_statement const& statement) { return statement.sql == sql; });
+        if (itr != prepared_.end())
+        {
+            prepared_.splice(prepared_.begin(), prepared_, itr);
+        }
+        else
+        {
+            if (prepared_.size() >= max_prepared_statements)
+            {
+                SQLFreeHandle(SQL_HANDLE_STMT, prepared_.back().hstmt);
+                prepared_.pop_back();
+            }
+
+            SQLHANDLE hstmt = NULL;
+            if (SQL_SUCCESS != SQLAllocHandle(SQL_HANDLE_STMT, sqlconnectionhandle, &hstmt))
+            {
+                throw mapnik::datasource_exception("SQLAllocHandle error");
+            }
+            SQLRETURN retcode = SQLPrepareA(hstmt, (SQLCHAR*)sql.c_str(), SQL_NTS);
+            if (!(retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO))
+            {
+                std::string err_msg = "Mssql Plugin: SQLPrepare error: ";
+                err_msg += getOdbcError(SQL_HANDLE_STMT, hstmt);
+                err_msg += "\nFull sql was: '";
+                err_msg += sql;
+                err_msg += "'\n";
+                SQLFreeHandle(SQL_HANDLE_STMT, hstmt);
+                throw mapnik::datasource_exception(err_msg);
+            }
+            prepared_.push_front(prepared_statement{sql, hstmt, sql_parameters()});
+            MAPNIK_LOG_DEBUG(mssql) << "mssql_connection: prepared statement " << prepared_.size() << "/" << max_prepared_statements;
+        }
+
+        prepared_statement& statement = prepared_.front();
+        statement.params = params;
+        statement.params.bind(statement.hstmt);
+        return &statement;
+    }
+
+    // also forgets a prepared statement, its execution failed
+    void freeStatement(SQLHANDLE hstmt)
     {
+        prepared_.remove_if([hstmt](prepared_statement const& statement) { return statement.hstmt == hstmt; });
         SQLFreeHandle(SQL_HANDLE_STMT, hstmt);
+    }
+
+    void freePreparedStatements()
+    {
+        for (auto const& statement : prepared_)
+        {
+            SQLFreeHandle(SQL_HANDLE_STMT, statement.hstmt);
+        }
+        prepared_.clear();
+    }
+
+    std::shared_ptr<ResultSet> makeResultSet(SQLHANDLE hstmt, std::size_t block_size, bool keep_handle)
+    {
+        if (block_size <= 1)
+        {
+            return std::make_shared<ResultSet>(hstmt, keep_handle);
+        }
+
+        // SQLGetData on a rowset of more than one row needs SQL_GD_BLOCK,
+        // without it the leading numeric columns are still bound
+        if (getdata_extensions_ < 0)
+        {
+            SQLUINTEGER extensions = 0;
+            if (SQLGetInfo(sqlconnectionhandle, SQL_GETDATA_EXTENSIONS, &extensions, sizeof(extensions), NULL) < 0)
+            {
+                extensions = 0;
+            }
+            getdata_extensions_ = extensions;
+            MAPNIK_LOG_DEBUG(mssql) << "mssql_connection: SQL_GETDATA_EXTENSIONS=" << extensions;
+            if (!(extensions & SQL_GD_BLOCK))
+            {
+                MAPNIK_LOG_WARN(mssql) << "mssql_connection: the driver does not support SQLGetData on block cursors, "
+                                       << "fetch_block_size=" << block_size << " is ignored and rows are fetched one by one";
+            }
+        }
+        return std::make_shared<BlockResultSet>(hstmt, (getdata_extensions_ & SQL_GD_BLOCK) ? block_size : 1, keep_handle);
+    }
+
+    void clearAsyncResult(SQLHANDLE hstmt)
+    {
+        freeStatement(hstmt);
         pending_ = false;
     }
 };
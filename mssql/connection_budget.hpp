@@ -0,0 +1,218 @@
+#ifndef MSSQL_CONNECTION_BUDGET_HPP
+#define MSSQL_CONNECTION_BUDGET_HPP
+
+#include <mapnik/debug.hpp>
+#include <mapnik/util/noncopyable.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Connections the pools of a process may open together, to one server or to
+// all of them, so the session count does not grow with the number of
+// datasources. A pool takes a permit for each connection it opens.
+//
+// The permits are not split in advance: a busy pool uses the ones idle
+// pools do not need. When they are all taken, a pool holding less than its
+// fair share, max_connections divided by the number of pools, gets one back
+// by closing an idle connection of a pool above its share. Pools above
+// their share also close the connections returned while others wait.
+class connection_budget : private mapnik::util::noncopyable
+{
+  public:
+    // a pool drawing on the budget
+    class member
+    {
+      public:
+        virtual ~member() {}
+        // connections open
+        virtual unsigned used() const = 0;
+        // closes one idle connection, false when there is none
+        virtual bool close_idle() = 0;
+        // borrowers waiting for a connection
+        virtual unsigned waiting() const = 0;
+        // a permit was returned, waiting borrowers may retry
+        virtual void wake() = 0;
+    };
+
+    explicit connection_budget(unsigned max_connections)
+        : max_connections_(std::max(max_connections, 1u)),
+          used_(0),
+          waiting_(0),
+          members_count_(0)
+    {
+    }
+
+    unsigned max_connections() const
+    {
+        return max_connections_.load(std::memory_order_acquire);
+    }
+
+    // the cap is only lowered, the connections above it close when returned
+    void set_max_connections(unsigned max_connections)
+    {
+        unsigned current = max_connections_.load(std::memory_order_relaxed);
+        max_connections = std::max(max_connections, 1u);
+        while (max_connections < current &&
+               !max_connections_.compare_exchange_weak(current, max_connections, std::memory_order_acq_rel))
+        {
+        }
+    }
+
+    unsigned used() const
+    {
+        return used_.load(std::memory_order_acquire);
+    }
+
+    void join(std::shared_ptr<member> const& m)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        prune();
+        members_.push_back(m);
+        members_count_.store(unsigned(members_.size()), std::memory_order_release);
+    }
+
+    // called by the destructor of a member, whose weak pointer has expired
+    void leave()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        prune();
+        members_count_.store(unsigned(members_.size()), std::memory_order_release);
+    }
+
+    // a permit for one more connection of m, already counted by m.used()
+    bool acquire(member const& m)
+    {
+        for (;;)
+        {
+            unsigned used = used_.load(std::memory_order_relaxed);
+            while (used < max_connections())
+            {
+                if (used_.compare_exchange_weak(used, used + 1, std::memory_order_acq_rel))
+                {
+                    return true;
+                }
+            }
+            if (!reclaim(m))
+            {
+                return false;
+            }
+        }
+    }
+
+    void release()
+    {
+        used_.fetch_sub(1, std::memory_order_acq_rel);
+        if (waiting_.load() > 0)
+        {
+            wake_members();
+        }
+    }
+
+    // borrowers waiting for a connection of any pool of the budget
+    void begin_wait()
+    {
+        ++waiting_;
+    }
+
+    void end_wait()
+    {
+        --waiting_;
+    }
+
+    // m should close a returned connection rather than keep it idle: it is
+    // above its share and another pool under its own waits
+    bool should_yield(member const& m) const
+    {
+        unsigned share = fair_share();
+        if (waiting_.load(std::memory_order_acquire) == 0 ||
+            used_.load(std::memory_order_acquire) < max_connections() ||
+            m.used() <= share)
+        {
+            return false;
+        }
+        for (auto const& other : members())
+        {
+            if (other.get() != &m && other->waiting() > 0 && other->used() < share)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+  private:
+    unsigned fair_share() const
+    {
+        return std::max(max_connections() / std::max(members_count_.load(std::memory_order_acquire), 1u), 1u);
+    }
+
+    // closes an idle connection of the pool furthest above its share, for
+    // m under its own
+    bool reclaim(member const& m)
+    {
+        unsigned share = fair_share();
+        if (m.used() > share)
+        {
+            return false;
+        }
+        std::shared_ptr<member> victim;
+        unsigned most = share;
+        for (auto const& other : members())
+        {
+            if (other.get() != &m && other->used() > most)
+            {
+                most = other->used();
+                victim = other;
+            }
+        }
+        if (victim && victim->close_idle())
+        {
+            MAPNIK_LOG_DEBUG(mssql) << "mssql_connection_budget: connection taken back from a pool above its share";
+            return true;
+        }
+        return false;
+    }
+
+    void wake_members()
+    {
+        for (auto const& m : members())
+        {
+            m->wake();
+        }
+    }
+
+    // used outside the lock: releasing the last reference to a member
+    // destroys it, which leaves the budget
+    std::vector<std::shared_ptr<member>> members() const
+    {
+        std::vector<std::shared_ptr<member>> result;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto const& weak : members_)
+        {
+            if (std::shared_ptr<member> m = weak.lock())
+            {
+                result.push_back(m);
+            }
+        }
+        return result;
+    }
+
+    void prune()
+    {
+        members_.erase(std::remove_if(members_.begin(), members_.end(),
+                                      [](std::weak_ptr<member> const& m) { return m.expired(); }),
+                       members_.end());
+    }
+
+    std::atomic<unsigned> max_connections_;
+    std::atomic<unsigned> used_;
+    std::atomic<unsigned> waiting_;
+    std::atomic<unsigned> members_count_;
+    std::vector<std::weak_ptr<member>> members_;
+    mutable std::mutex mutex_;
+};
+
+#endif // MSSQL_CONNECTION_BUDGET_HPP
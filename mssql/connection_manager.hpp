@@ -24,21 +24,24 @@
 #define MSSQL_CONNECTION_MANAGER_HPP
 
 #include "connection.hpp"
+#include "connection_pool.hpp"
 #include "odbc.hpp"
 
 // mapnik
-#include <mapnik/pool.hpp>
 #include <mapnik/util/singleton.hpp>
 
 // boost
+#include <boost/algorithm/string.hpp>
 #include <boost/optional.hpp>
 
 // stl
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 
-using mapnik::Pool;
 using mapnik::singleton;
 using mapnik::CreateStatic;
 
@@ -76,6 +79,28 @@ class ConnectionCreator
         return connection_string();
     }
 
+    // the server the connections go to, empty when unknown
+    inline std::string server() const
+    {
+        if (connection_string_ && !connection_string_->empty())
+        {
+            std::string lower = boost::algorithm::to_lower_copy(*connection_string_);
+            std::size_t pos = lower.find("server=");
+            if (pos == std::string::npos)
+            {
+                return std::string();
+            }
+            pos += 7;
+            return boost::algorithm::trim_copy(lower.substr(pos, lower.find(';', pos) - pos));
+        }
+        std::string server = host_ ? boost::algorithm::to_lower_copy(*host_) : std::string();
+        if (port_ && !port_->empty())
+        {
+            server += "," + *port_;
+        }
+        return server;
+    }
+
     inline std::string connection_string() const
     {
         std::string connect_str = connection_string_safe();
@@ -148,7 +173,7 @@ class ConnectionManager : public singleton<ConnectionManager, CreateStatic>
 {
 
   public:
-    using PoolType = Pool<Connection, ConnectionCreator>;
+    using PoolType = ConnectionPool<Connection, ConnectionCreator>;
 
   private:
     friend class CreateStatic<ConnectionManager>;
@@ -156,39 +181,116 @@ class ConnectionManager : public singleton<ConnectionManager, CreateStatic>
     using ContType = std::map<std::string, std::shared_ptr<PoolType>>;
     using HolderType = std::shared_ptr<Connection>;
     ContType pools_;
+    // per server, or a single one under an empty key
+    std::map<std::string, std::shared_ptr<connection_budget>> budgets_;
+    std::atomic<unsigned> fork_generation_;
+    std::mutex mutex_;
 
-  public:
-    bool registerPool(ConnectionCreator<Connection> const& creator, unsigned initialSize, unsigned maxSize)
+    // a forked process must neither use nor close the connections of its
+    // parent: the pools are replaced by empty ones, and the old ones are
+    // never destroyed
+    void renewPools()
     {
-        ContType::const_iterator itr = pools_.find(creator.id());
+        std::lock_guard<std::mutex> lock(mutex_);
+        unsigned generation = getForkGeneration();
+        if (fork_generation_.load(std::memory_order_relaxed) == generation)
+        {
+            return;
+        }
+        MAPNIK_LOG_DEBUG(mssql) << "mssql_connection_manager: renewing " << pools_.size() << " pool(s) after fork";
+        std::map<connection_budget const*, std::shared_ptr<connection_budget>> renewed;
+        for (auto& budget : budgets_)
+        {
+            std::shared_ptr<connection_budget> fresh = std::make_shared<connection_budget>(budget.second->max_connections());
+            renewed[budget.second.get()] = fresh;
+            budget.second = fresh;
+        }
+        for (auto& pool : pools_)
+        {
+            std::shared_ptr<connection_budget> const& budget = pool.second->budget();
+            new std::shared_ptr<PoolType>(pool.second); // leaked on purpose
+            pool.second = pool.second->renew(budget ? renewed[budget.get()] : std::shared_ptr<connection_budget>());
+        }
+        fork_generation_.store(generation, std::memory_order_release);
+    }
 
-        if (itr != pools_.end())
+  public:
+    // maxWaiters, health and the budget of a pool are only set when it is
+    // created. budget is the most connections of the pools sharing it, all
+    // of them or those to the same server with budgetPerHost, 0 for none.
+    bool registerPool(ConnectionCreator<Connection> const& creator, unsigned initialSize, unsigned maxSize,
+                      std::chrono::milliseconds borrowTimeout, unsigned maxWaiters,
+                      pool_health_options const& health, pool_warm_up warmUp, pool_warm_up forkWarmUp,
+                      unsigned budget, bool budgetPerHost)
+    {
+        if (fork_generation_.load(std::memory_order_acquire) != getForkGeneration())
         {
-            itr->second->set_initial_size(initialSize);
-            itr->second->set_max_size(maxSize);
+            renewPools();
         }
-        else
+
+        std::shared_ptr<PoolType> pool;
+        bool inserted = false;
         {
-            return pools_.insert(
-                             std::make_pair(creator.id(),
-                                            std::make_shared<PoolType>(creator, initialSize, maxSize)))
-                .second;
+            std::lock_guard<std::mutex> lock(mutex_);
+            ContType::const_iterator itr = pools_.find(creator.id());
+            if (itr != pools_.end())
+            {
+                pool = itr->second;
+                pool->set_initial_size(initialSize);
+                pool->set_max_size(maxSize);
+                pool->set_borrow_timeout(borrowTimeout);
+                pool->set_fork_warm_up(forkWarmUp);
+                if (pool->budget() && budget > 0)
+                {
+                    pool->budget()->set_max_connections(budget);
+                }
+            }
+            else
+            {
+                pool = std::make_shared<PoolType>(creator, initialSize, maxSize, borrowTimeout, maxWaiters, health);
+                if (budget > 0)
+                {
+                    std::shared_ptr<connection_budget>& shared = budgets_[budgetPerHost ? creator.server() : std::string()];
+                    if (shared)
+                    {
+                        shared->set_max_connections(budget);
+                    }
+                    else
+                    {
+                        shared = std::make_shared<connection_budget>(budget);
+                    }
+                    pool->set_budget(shared);
+                }
+                pool->set_fork_warm_up(forkWarmUp);
+                pools_.insert(std::make_pair(creator.id(), pool));
+                inserted = true;
+                pool->start_maintenance();
+            }
         }
-        return false;
+
+        // outside the lock, a synchronous warm up opens connections
+        pool->warm_up(warmUp);
+        return inserted;
     }
 
     std::shared_ptr<PoolType> getPool(std::string const& key)
     {
+        if (fork_generation_.load(std::memory_order_acquire) != getForkGeneration())
+        {
+            renewPools();
+        }
+        // a copy made under the lock, renewPools() may replace the pool
+        std::lock_guard<std::mutex> lock(mutex_);
         ContType::const_iterator itr = pools_.find(key);
         if (itr != pools_.end())
         {
             return itr->second;
         }
-        static const std::shared_ptr<PoolType> emptyPool;
-        return emptyPool;
+        return std::shared_ptr<PoolType>();
     }
 
-    ConnectionManager() {}
+    ConnectionManager()
+        : fork_generation_(getForkGeneration()) {}
   private:
     ConnectionManager(const ConnectionManager&);
     ConnectionManager& operator=(const ConnectionManager);
@@ -0,0 +1,802 @@
+#ifndef MSSQL_CONNECTION_POOL_HPP
+#define MSSQL_CONNECTION_POOL_HPP
+
+#include <mapnik/debug.hpp>
+#include <mapnik/util/noncopyable.hpp>
+
+#include "connection_budget.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// How the initial_size connections are opened
+enum pool_warm_up
+{
+    WARM_UP_LAZY,      // one at a time, by the first borrows
+    WARM_UP_SYNC,      // concurrently, the caller waits for them
+    WARM_UP_BACKGROUND // concurrently, while the pool is already used
+};
+
+// Checks of the pooled connections, a zero duration disables one
+struct pool_health_options
+{
+    // idle connections are checked, replaced or closed in the background
+    // at this interval
+    std::chrono::seconds check_interval = std::chrono::seconds(0);
+    // the maintenance pings the connections idle this long
+    std::chrono::seconds ping_interval = std::chrono::seconds(0);
+    // idle connections above initial_size are closed after this long
+    std::chrono::seconds idle_timeout = std::chrono::seconds(0);
+    // connections are replaced once this old
+    std::chrono::seconds max_lifetime = std::chrono::seconds(0);
+};
+
+// Pool of connections to one server, in place of mapnik::Pool which opens
+// connections while holding its mutex, so one slow login stalls every
+// thread borrowing from it.
+//
+// Each connection sits in a slot whose state is changed by compare and swap:
+// borrowing an idle connection takes no lock. Connections are opened by the
+// borrowing thread, outside any lock, once it has reserved a slot. When all
+// of them are in use, at most max_waiters threads wait up to borrow_timeout
+// for one to be returned, the others get an empty pointer at once. A thread
+// first tries the connection it returned last, still warm for its queries.
+//
+// A borrowed connection goes back to the pool when its last shared_ptr is
+// released, a closed one is then disconnected and its slot freed.
+//
+// Connections are only checked on borrow with isOK(), which asks the driver
+// without a round trip. The round trips are left to the maintenance thread,
+// ahead of the borrowers: it pings the connections idle for a while, reopens
+// the broken and too old ones, closes the ones idle for too long and keeps
+// initial_size connections open.
+//
+// A pool given a connection_budget also needs a permit of the budget to open
+// a connection.
+template <typename T, template <typename> class Creator>
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool<T, Creator>>,
+                       public connection_budget::member,
+                       private mapnik::util::noncopyable
+{
+  public:
+    using HolderType = std::shared_ptr<T>;
+
+    ConnectionPool(Creator<T> const& creator, unsigned initial_size, unsigned max_size,
+                   std::chrono::milliseconds borrow_timeout = std::chrono::milliseconds(0),
+                   unsigned max_waiters = 64,
+                   pool_health_options const& health = pool_health_options())
+        : creator_(creator),
+          initial_size_(initial_size),
+          max_size_(0),
+          borrow_timeout_(borrow_timeout),
+          max_waiters_(max_waiters),
+          health_(health),
+          fork_warm_up_(WARM_UP_LAZY),
+          warm_up_time_(std::chrono::milliseconds(-1)),
+          num_slots_(0),
+          open_(0),
+          waiters_(0),
+          returned_generation_(0)
+    {
+        for (auto& chunk : chunks_)
+        {
+            chunk.store(nullptr, std::memory_order_relaxed);
+        }
+        set_max_size(max_size);
+    }
+
+    ~ConnectionPool()
+    {
+        if (maintenance_)
+        {
+            std::lock_guard<std::mutex> lock(maintenance_->mutex);
+            maintenance_->stop = true;
+            maintenance_->wake.notify_all();
+        }
+        // borrowed connections hold the pool, they are all idle here
+        std::size_t count = num_slots_.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if (at(i).conn)
+            {
+                delete at(i).conn;
+                if (budget_)
+                {
+                    budget_->release();
+                }
+            }
+        }
+        if (budget_)
+        {
+            budget_->leave();
+        }
+        for (auto& chunk : chunks_)
+        {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    // waits for a connection when all of them are in use
+    HolderType borrowObject()
+    {
+        return borrow(borrow_timeout_.load(std::memory_order_relaxed));
+    }
+
+    // never waits, for callers that can use a connection later
+    HolderType tryBorrowObject()
+    {
+        return borrow(std::chrono::milliseconds(0));
+    }
+
+    // open connections, borrowed or idle
+    unsigned size() const
+    {
+        return open_.load(std::memory_order_acquire);
+    }
+
+    unsigned max_size() const
+    {
+        return max_size_.load(std::memory_order_acquire);
+    }
+
+    // the pool is shared by the datasources of one server, it only grows
+    void set_max_size(unsigned size)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (size > max_slots)
+        {
+            MAPNIK_LOG_WARN(mssql) << "mssql_connection_pool: max_size " << size << " lowered to " << max_slots;
+            size = unsigned(max_slots);
+        }
+        if (size <= max_size_.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        std::size_t count = num_slots_.load(std::memory_order_relaxed);
+        while (count < size)
+        {
+            std::size_t c = count / chunk_size;
+            if (!chunks_[c].load(std::memory_order_relaxed))
+            {
+                chunks_[c].store(new slot[chunk_size], std::memory_order_release);
+            }
+            count = (c + 1) * chunk_size;
+        }
+        num_slots_.store(count, std::memory_order_release);
+        max_size_.store(size, std::memory_order_release);
+    }
+
+    unsigned initial_size() const
+    {
+        return initial_size_;
+    }
+
+    void set_initial_size(unsigned size)
+    {
+        initial_size_ = size;
+    }
+
+    std::chrono::milliseconds borrow_timeout() const
+    {
+        return borrow_timeout_.load(std::memory_order_relaxed);
+    }
+
+    void set_borrow_timeout(std::chrono::milliseconds timeout)
+    {
+        borrow_timeout_.store(timeout, std::memory_order_relaxed);
+    }
+
+    // set before the pool opens connections
+    void set_budget(std::shared_ptr<connection_budget> const& budget)
+    {
+        budget_ = budget;
+        if (budget_)
+        {
+            budget_->join(this->shared_from_this());
+        }
+    }
+
+    std::shared_ptr<connection_budget> const& budget() const
+    {
+        return budget_;
+    }
+
+    virtual unsigned used() const
+    {
+        return size();
+    }
+
+    virtual bool close_idle()
+    {
+        std::size_t count = num_slots_.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            slot& s = at(i);
+            int expected = IDLE;
+            if (s.state.compare_exchange_strong(expected, BUSY, std::memory_order_acquire))
+            {
+                discard(s);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    virtual unsigned waiting() const
+    {
+        return waiters_.load(std::memory_order_acquire);
+    }
+
+    virtual void wake()
+    {
+        notify();
+    }
+
+    // how the pool replacing this one in a forked process is warmed up
+    void set_fork_warm_up(pool_warm_up mode)
+    {
+        fork_warm_up_ = mode;
+    }
+
+    // an empty pool with the same settings, for a forked process: the
+    // connections of this one belong to the parent, as do the permits of
+    // its budget
+    std::shared_ptr<ConnectionPool> renew(std::shared_ptr<connection_budget> const& budget) const
+    {
+        std::shared_ptr<ConnectionPool> pool = std::make_shared<ConnectionPool>(
+            creator_, initial_size_, max_size(), borrow_timeout(), max_waiters_, health_);
+        pool->set_budget(budget);
+        pool->set_fork_warm_up(fork_warm_up_);
+        pool->start_maintenance();
+        pool->warm_up(fork_warm_up_);
+        return pool;
+    }
+
+    // opens the connections missing to reach initial_size, each on its own
+    // thread since a login mostly waits for the server. WARM_UP_SYNC throws
+    // the first error.
+    void warm_up(pool_warm_up mode)
+    {
+        if (mode == WARM_UP_SYNC)
+        {
+            open_initial();
+        }
+        else if (mode == WARM_UP_BACKGROUND)
+        {
+            std::shared_ptr<ConnectionPool> self = this->shared_from_this();
+            std::thread([self]() {
+                try
+                {
+                    self->open_initial();
+                }
+                catch (std::exception const& ex)
+                {
+                    MAPNIK_LOG_WARN(mssql) << "mssql_connection_pool: warm-up failed: " << ex.what();
+                }
+            }).detach();
+        }
+    }
+
+    // how long the last warm-up took, negative until one has completed
+    std::chrono::milliseconds warm_up_time() const
+    {
+        return warm_up_time_.load(std::memory_order_acquire);
+    }
+
+    // the thread only holds the pool while it checks the connections, it
+    // ends with the pool
+    void start_maintenance()
+    {
+        if (health_.check_interval.count() <= 0 || maintenance_)
+        {
+            return;
+        }
+        maintenance_ = std::make_shared<maintenance_state>();
+        std::weak_ptr<ConnectionPool> pool = this->shared_from_this();
+        std::shared_ptr<maintenance_state> state = maintenance_;
+        std::chrono::seconds interval = health_.check_interval;
+        std::thread([pool, state, interval]() {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            while (!state->wake.wait_for(lock, interval, [&state]() { return state->stop; }))
+            {
+                lock.unlock();
+                if (std::shared_ptr<ConnectionPool> self = pool.lock())
+                {
+                    self->maintain();
+                }
+                lock.lock();
+            }
+        }).detach();
+    }
+
+    // run by the maintenance thread
+    void maintain()
+    {
+        auto now = std::chrono::steady_clock::now();
+        std::size_t count = num_slots_.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            slot& s = at(i);
+            int expected = IDLE;
+            if (!s.state.compare_exchange_strong(expected, BUSY, std::memory_order_acquire))
+            {
+                continue;
+            }
+            if (expired(health_.idle_timeout, s.returned, now) && open_.load(std::memory_order_acquire) > initial_size_)
+            {
+                MAPNIK_LOG_DEBUG(mssql) << "mssql_connection_pool: closing idle connection";
+                discard(s);
+            }
+            else if (expired(health_.max_lifetime, s.opened, now) || !healthy(s, now))
+            {
+                MAPNIK_LOG_DEBUG(mssql) << "mssql_connection_pool: replacing connection";
+                delete s.conn;
+                s.conn = nullptr;
+                reopen(i);
+            }
+            else
+            {
+                s.state.store(IDLE, std::memory_order_release);
+            }
+        }
+
+        // replaces the connections closed while borrowed
+        while (open_.load(std::memory_order_acquire) < initial_size_ && reserve())
+        {
+            if (!reopen(reserve_slot()))
+            {
+                break;
+            }
+        }
+    }
+
+  private:
+    enum slot_state
+    {
+        EMPTY,
+        OPENING,
+        IDLE,
+        BUSY
+    };
+
+    struct slot
+    {
+        slot()
+            : state(EMPTY),
+              conn(nullptr) {}
+
+        std::atomic<int> state;
+        // only read or written by the thread which moved the slot out of
+        // IDLE or EMPTY
+        T* conn;
+        std::chrono::steady_clock::time_point opened;
+        std::chrono::steady_clock::time_point returned;
+        std::chrono::steady_clock::time_point checked;
+    };
+
+    struct maintenance_state
+    {
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stop = false;
+    };
+
+    // the connection a thread returned last, per pool
+    struct affinity
+    {
+        const void* pool;
+        std::size_t index;
+    };
+
+    static const std::size_t chunk_size = 32;
+    static const std::size_t max_chunks = 64;
+    static const std::size_t max_slots = chunk_size * max_chunks;
+    static const std::size_t max_affinities = 4;
+
+    slot& at(std::size_t index) const
+    {
+        return chunks_[index / chunk_size].load(std::memory_order_acquire)[index % chunk_size];
+    }
+
+    static affinity* affinities()
+    {
+        static thread_local affinity entries[max_affinities] = {};
+        return entries;
+    }
+
+    std::size_t* last_returned() const
+    {
+        affinity* entries = affinities();
+        for (std::size_t i = 0; i < max_affinities; ++i)
+        {
+            if (entries[i].pool == this)
+            {
+                return &entries[i].index;
+            }
+        }
+        return nullptr;
+    }
+
+    void remember(std::size_t index) const
+    {
+        std::size_t* last = last_returned();
+        if (!last)
+        {
+            // the oldest entry is replaced
+            affinity* entries = affinities();
+            std::rotate(entries, entries + max_affinities - 1, entries + max_affinities);
+            entries[0].pool = this;
+            last = &entries[0].index;
+        }
+        *last = index;
+    }
+
+    HolderType borrow(std::chrono::milliseconds timeout)
+    {
+        HolderType conn = take_idle();
+        if (conn)
+        {
+            return conn;
+        }
+        conn = open();
+        if (conn || timeout.count() <= 0)
+        {
+            return conn;
+        }
+        return wait(timeout);
+    }
+
+    // lock free: claims an idle slot, the last one returned by this thread
+    // first
+    HolderType take_idle()
+    {
+        std::size_t count = num_slots_.load(std::memory_order_acquire);
+        std::size_t* last = last_returned();
+        if (last && *last < count)
+        {
+            HolderType conn = take(*last);
+            if (conn)
+            {
+                return conn;
+            }
+        }
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            HolderType conn = take(i);
+            if (conn)
+            {
+                return conn;
+            }
+        }
+        return HolderType();
+    }
+
+    HolderType take(std::size_t index)
+    {
+        slot& s = at(index);
+        int expected = IDLE;
+        if (!s.state.compare_exchange_strong(expected, BUSY, std::memory_order_acquire))
+        {
+            return HolderType();
+        }
+        if (!s.conn->isOK())
+        {
+            // lost while idle
+            discard(s);
+            return HolderType();
+        }
+        return hold(index);
+    }
+
+    static bool expired(std::chrono::seconds limit, std::chrono::steady_clock::time_point since,
+                        std::chrono::steady_clock::time_point now)
+    {
+        return limit.count() > 0 && now - since >= limit;
+    }
+
+    // run by the maintenance only, ping() is a round trip to the server
+    bool healthy(slot& s, std::chrono::steady_clock::time_point now) const
+    {
+        if (!s.conn->isOK())
+        {
+            return false;
+        }
+        if (expired(health_.ping_interval, std::max(s.returned, s.checked), now))
+        {
+            s.checked = now;
+            return s.conn->ping();
+        }
+        return true;
+    }
+
+    // opens a connection if the pool is not full, outside any lock
+    HolderType open()
+    {
+        if (!reserve())
+        {
+            return HolderType();
+        }
+        std::size_t index = reserve_slot();
+        if (!connect(index))
+        {
+            return HolderType();
+        }
+        at(index).state.store(BUSY, std::memory_order_release);
+        return hold(index);
+    }
+
+    // the slot is freed again when the connection cannot be opened
+    bool connect(std::size_t index)
+    {
+        slot& s = at(index);
+        try
+        {
+            s.conn = creator_();
+        }
+        catch (...)
+        {
+            unreserve(s);
+            throw;
+        }
+        if (!s.conn->isOK())
+        {
+            discard(s);
+            return false;
+        }
+        s.opened = s.returned = s.checked = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void open_initial()
+    {
+        auto start = std::chrono::steady_clock::now();
+        unsigned open = open_.load(std::memory_order_acquire);
+        unsigned missing = initial_size_ > open ? initial_size_ - open : 0;
+        std::vector<std::exception_ptr> errors(missing);
+        std::vector<std::thread> threads;
+        std::atomic<unsigned> opened(0);
+        for (unsigned i = 0; i < missing; ++i)
+        {
+            threads.emplace_back([this, i, &errors, &opened]() {
+                if (!reserve())
+                {
+                    return;
+                }
+                std::size_t index = reserve_slot();
+                try
+                {
+                    if (connect(index))
+                    {
+                        at(index).state.store(IDLE, std::memory_order_release);
+                        notify();
+                        ++opened;
+                    }
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        std::chrono::milliseconds elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        warm_up_time_.store(elapsed, std::memory_order_release);
+        MAPNIK_LOG_DEBUG(mssql) << "mssql_connection_pool: warm-up opened " << opened.load() << " connection(s) in "
+                                << elapsed.count() << "ms";
+        for (auto const& error : errors)
+        {
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    // connects a reserved slot from the maintenance thread, which has no
+    // caller to report a failure to
+    bool reopen(std::size_t index)
+    {
+        try
+        {
+            if (connect(index))
+            {
+                at(index).state.store(IDLE, std::memory_order_release);
+                notify();
+                return true;
+            }
+        }
+        catch (std::exception const& ex)
+        {
+            MAPNIK_LOG_WARN(mssql) << "mssql_connection_pool: cannot reopen connection: " << ex.what();
+        }
+        return false;
+    }
+
+    HolderType wait(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (waiters_.load(std::memory_order_relaxed) >= max_waiters_)
+        {
+            MAPNIK_LOG_WARN(mssql) << "mssql_connection_pool: too many threads waiting for a connection";
+            return HolderType();
+        }
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        ++waiters_;
+        if (budget_)
+        {
+            budget_->begin_wait();
+        }
+        HolderType conn;
+        for (;;)
+        {
+            // a connection returned while this thread looks bumps the
+            // generation, so the wait below does not miss its signal
+            unsigned generation = returned_generation_;
+            lock.unlock();
+            try
+            {
+                conn = take_idle();
+                if (!conn)
+                {
+                    conn = open();
+                }
+            }
+            catch (...)
+            {
+                lock.lock();
+                end_wait();
+                throw;
+            }
+            lock.lock();
+            if (conn)
+            {
+                break;
+            }
+            if (!returned_.wait_until(lock, deadline, [this, generation]() { return returned_generation_ != generation; }))
+            {
+                // a last look, one may have been returned at the deadline
+                lock.unlock();
+                conn = take_idle();
+                lock.lock();
+                break;
+            }
+        }
+        end_wait();
+        if (!conn)
+        {
+            MAPNIK_LOG_WARN(mssql) << "mssql_connection_pool: no connection returned after " << timeout.count() << "ms";
+        }
+        return conn;
+    }
+
+    void end_wait()
+    {
+        --waiters_;
+        if (budget_)
+        {
+            budget_->end_wait();
+        }
+    }
+
+    bool reserve()
+    {
+        unsigned open = open_.load(std::memory_order_relaxed);
+        do
+        {
+            if (open >= max_size_.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+        } while (!open_.compare_exchange_weak(open, open + 1, std::memory_order_acq_rel));
+        if (budget_ && !budget_->acquire(*this))
+        {
+            open_.fetch_sub(1, std::memory_order_acq_rel);
+            return false;
+        }
+        return true;
+    }
+
+    // there are at most max_size reservations, so an empty slot is found
+    std::size_t reserve_slot()
+    {
+        for (;;)
+        {
+            std::size_t count = num_slots_.load(std::memory_order_acquire);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                int expected = EMPTY;
+                if (at(i).state.compare_exchange_strong(expected, OPENING, std::memory_order_acquire))
+                {
+                    return i;
+                }
+            }
+        }
+    }
+
+    void discard(slot& s)
+    {
+        delete s.conn;
+        unreserve(s);
+    }
+
+    void unreserve(slot& s)
+    {
+        s.conn = nullptr;
+        s.state.store(EMPTY, std::memory_order_release);
+        open_.fetch_sub(1, std::memory_order_acq_rel);
+        if (budget_)
+        {
+            budget_->release();
+        }
+        notify();
+    }
+
+    HolderType hold(std::size_t index)
+    {
+        std::shared_ptr<ConnectionPool> self = this->shared_from_this();
+        return HolderType(at(index).conn, [self, index](T*) { self->release(index); });
+    }
+
+    void release(std::size_t index)
+    {
+        slot& s = at(index);
+        if (!s.conn->isOK() || (budget_ && budget_->should_yield(*this)))
+        {
+            // a closed connection, or one needed by a pool under its share
+            discard(s);
+        }
+        else
+        {
+            s.returned = std::chrono::steady_clock::now();
+            s.state.store(IDLE, std::memory_order_release);
+            remember(index);
+            notify();
+        }
+    }
+
+    void notify()
+    {
+        // the mutex is only taken when a thread waits. The fence orders the
+        // store making a slot idle or empty before the load of waiters_, the
+        // waiters raise it before looking at the slots.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++returned_generation_;
+            returned_.notify_one();
+        }
+    }
+
+    const Creator<T> creator_;
+    unsigned initial_size_;
+    std::atomic<unsigned> max_size_;
+    std::atomic<std::chrono::milliseconds> borrow_timeout_;
+    const unsigned max_waiters_;
+    const pool_health_options health_;
+    pool_warm_up fork_warm_up_;
+    std::atomic<std::chrono::milliseconds> warm_up_time_;
+    std::shared_ptr<connection_budget> budget_;
+    mutable std::atomic<slot*> chunks_[max_chunks];
+    std::atomic<std::size_t> num_slots_;
+    std::atomic<unsigned> open_;
+    std::atomic<unsigned> waiters_;
+    std::mutex mutex_;
+    std::condition_variable returned_;
+    unsigned returned_generation_; // guarded by mutex_
+    std::shared_ptr<maintenance_state> maintenance_;
+};
+
+#endif // MSSQL_CONNECTION_POOL_HPP
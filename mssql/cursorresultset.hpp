@@ -26,18 +26,23 @@
 #include <mapnik/debug.hpp>
 
 #include "connection.hpp"
+#include "connection_manager.hpp"
 #include "resultset.hpp"
 #include <memory>
 class CursorResultSet : public IResultSet, private mapnik::util::noncopyable
 {
   public:
-    CursorResultSet(std::shared_ptr<Pool<Connection, ConnectionCreator>> const& pool,
+    CursorResultSet(std::shared_ptr<ConnectionPool<Connection, ConnectionCreator>> const& pool,
                     std::shared_ptr<Connection> const& conn,
-                    std::string const& sql)
+                    std::string const& sql,
+                    sql_parameters const& params = sql_parameters(),
+                    std::size_t block_size = 0)
         : pool_(pool),
           conn_(conn),
           sql_(sql),
-          is_closed_(false)
+          params_(params),
+          is_closed_(false),
+          block_size_(block_size)
     {
     }
 
@@ -50,9 +55,13 @@ class CursorResultSet : public IResultSet, private mapnik::util::noncopyable
     {
         if (!is_closed_)
         {
-            rs_.reset();
+            if (rs_)
+            {
+                rs_->cancel();
+                rs_.reset();
+            }
 
-            conn_->close();
+            // the connection goes back to the pool, still open
             is_closed_ = true;
             conn_.reset();
         }
@@ -76,6 +85,8 @@ class CursorResultSet : public IResultSet, private mapnik::util::noncopyable
         }
         else
         {
+            // all rows read, nothing to cancel
+            rs_.reset();
             close();
             return false;
         }
@@ -136,6 +147,16 @@ class CursorResultSet : public IResultSet, private mapnik::util::noncopyable
         return rs_->getBinary(index);
     }
 
+    virtual binary_view getBinaryView(int index) const
+    {
+        return rs_->getBinaryView(index);
+    }
+
+    virtual binary_view getUtf16View(int index) const
+    {
+        return rs_->getUtf16View(index);
+    }
+
   private:
     void getNextResultSet()
     {
@@ -147,15 +168,17 @@ class CursorResultSet : public IResultSet, private mapnik::util::noncopyable
                 throw mapnik::datasource_exception("Mssql Plugin: bad connection");
             }
         }
-        rs_ = conn_->executeQuery(sql_.c_str());
+        rs_ = conn_->executeQuery(sql_, params_, block_size_);
         is_closed_ = false;
     }
-    std::shared_ptr<Pool<Connection, ConnectionCreator>> pool_;
+    std::shared_ptr<ConnectionPool<Connection, ConnectionCreator>> pool_;
     std::shared_ptr<Connection> conn_;
     std::shared_ptr<ResultSet> rs_;
 
     std::string sql_;
+    sql_parameters params_;
     bool is_closed_;
+    std::size_t block_size_;
 };
 
 #endif // MSSQL_CURSORRESULTSET_HPP
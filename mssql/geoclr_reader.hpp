@@ -1,218 +1,668 @@
 #ifndef MSSQL_GEOCLR_READER_HPP
 #define MSSQL_GEOCLR_READER_HPP
 
+#include <mapnik/debug.hpp>
 #include <mapnik/geometry.hpp>
-#include <mapnik/geometry_correct.hpp>
 #include <mapnik/util/noncopyable.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <vector>
 
+#include "geometry_clip.hpp"
+#include "geometry_simplify.hpp"
 #include "mssqlclrgeo.hpp"
 
+struct geometry_decode_options
+{
+    geometry_decode_options()
+        : arc_tolerance(0),
+          trust_orientation(false),
+          clip(false),
+          filter(false),
+          simplify(geometry_simplify::NONE),
+          simplify_tolerance(0) {}
+
+    // max distance between a circular arc and its linearization, in data units
+    // (usually a fraction of the query pixel size). 0 uses a fixed angular step.
+    double arc_tolerance;
+
+    // keep the ring orientation of geometry values as stored. Geography rings
+    // always follow the left-hand rule, which is what mapnik expects.
+    bool trust_orientation;
+
+    // clip lines and polygons to clip_box, dropping the parts outside of it
+    bool clip;
+    mapnik::box2d<double> clip_box;
+
+    // drop the geometries whose envelope does not intersect filter_box, the
+    // server only ran the primary filter of the spatial index
+    bool filter;
+    mapnik::box2d<double> filter_box;
+
+    // client side simplification, tolerance in data units
+    geometry_simplify::algorithm simplify;
+    double simplify_tolerance;
+};
+
+// Appends the vertices approximating the circular arc p0 -> p1 -> p2 to line,
+// p0 excluded and p2 included.
+template <typename Line>
+void linearize_arc(mssqlclr::Point const& p0, mssqlclr::Point const& p1, mssqlclr::Point const& p2,
+                   double tolerance, Line& line)
+{
+    const double pi = 3.14159265358979323846;
+    const unsigned max_segments = 4096;
+
+    double cx, cy;
+    double sweep;
+    double cross = (p1.X - p0.X) * (p2.Y - p1.Y) - (p1.Y - p0.Y) * (p2.X - p1.X);
+    if (p0.X == p2.X && p0.Y == p2.Y)
+    {
+        // full circle, p1 is the opposite point
+        cx = (p0.X + p1.X) / 2;
+        cy = (p0.Y + p1.Y) / 2;
+        sweep = 2 * pi;
+    }
+    else if (cross == 0)
+    {
+        // collinear points, this is a straight line
+        line.emplace_back(p1.X, p1.Y);
+        line.emplace_back(p2.X, p2.Y);
+        return;
+    }
+    else
+    {
+        // circumcenter of the three points, relative to p0 to keep precision
+        // with large projected coordinates
+        double bx = p1.X - p0.X, by = p1.Y - p0.Y;
+        double ex = p2.X - p0.X, ey = p2.Y - p0.Y;
+        double b2 = bx * bx + by * by;
+        double e2 = ex * ex + ey * ey;
+        double d = 2 * cross;
+        cx = p0.X + (ey * b2 - by * e2) / d;
+        cy = p0.Y + (bx * e2 - ex * b2) / d;
+
+        double a0 = std::atan2(p0.Y - cy, p0.X - cx);
+        double a2 = std::atan2(p2.Y - cy, p2.X - cx);
+        sweep = a2 - a0;
+        if (cross > 0)
+        {
+            // counterclockwise
+            while (sweep <= 0)
+            {
+                sweep += 2 * pi;
+            }
+        }
+        else
+        {
+            while (sweep >= 0)
+            {
+                sweep -= 2 * pi;
+            }
+        }
+    }
+
+    double radius = std::sqrt((p0.X - cx) * (p0.X - cx) + (p0.Y - cy) * (p0.Y - cy));
+    if (cross == 0 && radius == 0)
+    {
+        line.emplace_back(p2.X, p2.Y);
+        return;
+    }
+
+    // largest step keeping the chord within tolerance of the arc
+    double max_step = pi / 32;
+    if (tolerance > 0)
+    {
+        max_step = tolerance < radius ? 2 * std::acos(1 - tolerance / radius) : pi;
+    }
+    double steps = std::ceil(std::fabs(sweep) / max_step);
+    if (!(steps >= 1)) // nan coordinates
+    {
+        line.emplace_back(p2.X, p2.Y);
+        return;
+    }
+    unsigned segments = steps < max_segments ? unsigned(steps) : max_segments;
+    if (segments < 2 && cross == 0)
+    {
+        segments = 2; // keep a closed circle as a ring
+    }
+
+    double a0 = std::atan2(p0.Y - cy, p0.X - cx);
+    for (unsigned i = 1; i < segments; ++i)
+    {
+        double a = a0 + sweep * i / segments;
+        line.emplace_back(cx + radius * std::cos(a), cy + radius * std::sin(a));
+    }
+    line.emplace_back(p2.X, p2.Y);
+}
+
+// Converts a serialized SQL Server geometry/geography to a mapnik geometry.
+// Shapes are stored in pre-order (a parent is followed by all its descendants),
+// so the whole geometry is decoded in a single pass over the shapes array,
+// reading points straight from the source buffer.
 struct mapnik_geoclr_reader : mapnik::util::noncopyable
 {
   private:
-    mssqlclr::sqlgeo_reader reader;
-    uint32_t shape_pos_;
     mssqlclr::Geometry geo_;
-    bool is_geography_;
+    geometry_decode_options const& options_;
+    geometry_simplify::simplifier* simplifier_;
+    uint32_t shape_pos_;
+    uint32_t segment_pos_;
 
-  public:
-    mapnik_geoclr_reader(const char* data, std::size_t size, bool isGeography)
-        : reader(mssqlclr::sqlgeo_reader(data, size)),
-          shape_pos_(0),
-          is_geography_(isGeography)
+    bool is_child(uint32_t shape_idx, uint32_t parent_idx) const
     {
-        geo_ = reader.parseGeometry(is_geography_);
+        return shape_idx < geo_.NumShapes && geo_.getShape(shape_idx).ParentOffset == int32_t(parent_idx);
     }
 
-    mapnik::geometry::point<double> read_point(mssqlclr::Shape shape)
+    uint32_t count_children(uint32_t parent_idx) const
     {
+        uint32_t count = 0;
+        while (is_child(parent_idx + 1 + count, parent_idx))
+        {
+            ++count;
+        }
+        return count;
+    }
 
-        auto figures = geo_.getFiguresFromShape(shape_pos_);
-        auto pt_offset = figures[0].Offset;
+    // points are copied in bulk straight into the vertex storage
+    static_assert(sizeof(mapnik::geometry::point<double>) == 2 * sizeof(double), "point must be a pair of doubles");
 
-        double x = geo_.Points[pt_offset].X;
-        double y = geo_.Points[pt_offset].Y;
+    template <typename Line>
+    void read_points(uint32_t figure_idx, Line& line)
+    {
+        uint32_t begin, end;
+        geo_.getPointRange(figure_idx, begin, end);
+        if (end <= begin)
+        {
+            return;
+        }
+        line.resize(end - begin);
+        geo_.copyPoints(begin, end, reinterpret_cast<double*>(line.data()));
+    }
 
-        return mapnik::geometry::point<double>(x, y);
+    // circular string: arcs p0 p1 p2, p2 p3 p4, ...
+    template <typename Line>
+    void read_arcs(uint32_t figure_idx, Line& line)
+    {
+        uint32_t begin, end;
+        geo_.getPointRange(figure_idx, begin, end);
+        if (end <= begin)
+        {
+            return;
+        }
+        line.reserve(end - begin);
+        mssqlclr::Point start = geo_.getPoint(begin);
+        line.emplace_back(start.X, start.Y);
+        for (uint32_t i = begin; i + 2 < end; i += 2)
+        {
+            linearize_arc(geo_.getPoint(i), geo_.getPoint(i + 1), geo_.getPoint(i + 2), options_.arc_tolerance, line);
+        }
     }
-    mapnik::geometry::multi_point<double> read_multipoint(mssqlclr::Shape shape)
+
+    // compound curve: a run of line and arc segments sharing their end points,
+    // segments of all composite figures are stored in figure order
+    template <typename Line>
+    void read_composite(uint32_t figure_idx, Line& line)
     {
+        uint32_t begin, end;
+        geo_.getPointRange(figure_idx, begin, end);
+        if (end <= begin)
+        {
+            return;
+        }
+        line.reserve(end - begin);
+        mssqlclr::Point start = geo_.getPoint(begin);
+        line.emplace_back(start.X, start.Y);
 
-        mapnik::geometry::multi_point<double> multi_point;
+        uint32_t i = begin;
+        bool first = true;
+        while (segment_pos_ < geo_.NumSegments)
+        {
+            mssqlclr::SEGMENT type = geo_.getSegment(segment_pos_);
+            bool is_first = type == mssqlclr::SEGMENT_FIRST_LINE || type == mssqlclr::SEGMENT_FIRST_ARC;
+            if (is_first != first)
+            {
+                break; // start of the next figure
+            }
+            first = false;
+            ++segment_pos_;
 
-        mssqlclr::Geometry parent_geo = geo_;
-        uint32_t parent_pos = shape_pos_;
-        while ((parent_geo.Shapes.size() - 1 >= shape_pos_ + 1) && parent_geo.Shapes[shape_pos_ + 1].ParentOffset == parent_pos)
+            if (type == mssqlclr::SEGMENT_LINE || type == mssqlclr::SEGMENT_FIRST_LINE)
+            {
+                if (i + 1 >= end)
+                {
+                    break;
+                }
+                mssqlclr::Point p = geo_.getPoint(++i);
+                line.emplace_back(p.X, p.Y);
+            }
+            else
+            {
+                if (i + 2 >= end)
+                {
+                    break;
+                }
+                linearize_arc(geo_.getPoint(i), geo_.getPoint(i + 1), geo_.getPoint(i + 2), options_.arc_tolerance, line);
+                i += 2;
+            }
+        }
+    }
+
+    bool is_curve(uint32_t figure_idx) const
+    {
+        mssqlclr::FIGURE attribute = geo_.getFigure(figure_idx).Attribute;
+        return geo_.Version >= 2 && (attribute == mssqlclr::FIGURE_V2_ARC || attribute == mssqlclr::FIGURE_V2_COMPOSITE_CURVE);
+    }
+
+    // position of the box relative to a figure, from the serialized points so
+    // figures outside the clip box are skipped before anything is allocated.
+    // Arcs can bulge out of their points bounds and are tested once linearized.
+    geometry_clip::relation relate_figure(uint32_t figure_idx) const
+    {
+        if (!options_.clip)
         {
-            shape_pos_++;
-            multi_point.emplace_back(read_point(parent_geo.Shapes[shape_pos_]));
+            return geometry_clip::INSIDE;
+        }
+        if (is_curve(figure_idx))
+        {
+            return geometry_clip::CROSSES;
+        }
+        uint32_t begin, end;
+        geo_.getPointRange(figure_idx, begin, end);
+        if (begin >= end)
+        {
+            return geometry_clip::DISJOINT;
         }
+        double minx, miny, maxx, maxy;
+        geo_.getBounds(begin, end, minx, miny, maxx, maxy);
+        return geometry_clip::relate(options_.clip_box, minx, miny, maxx, maxy);
+    }
 
-        return multi_point;
+    template <typename Line>
+    void simplify(Line& line, bool ring)
+    {
+        if (simplifier_ && !line.empty())
+        {
+            simplifier_->apply(line, ring);
+        }
+    }
+
+    // reads a figure, clips it when it crosses the clip box and simplifies it,
+    // the figure is left empty when nothing remains
+    void read_ring(uint32_t figure_idx, mapnik::geometry::linear_ring<double>& ring)
+    {
+        geometry_clip::relation rel = relate_figure(figure_idx);
+        if (rel == geometry_clip::DISJOINT)
+        {
+            return;
+        }
+        read_figure(figure_idx, ring);
+        if (rel == geometry_clip::CROSSES && geometry_clip::relate(options_.clip_box, ring) != geometry_clip::INSIDE)
+        {
+            geometry_clip::clip_ring(ring, options_.clip_box);
+        }
+        simplify(ring, true);
     }
 
-    mapnik::geometry::line_string<double> read_linestring(mssqlclr::Shape shape)
+    template <typename Parts>
+    void read_line_parts(Parts& parts)
     {
+        uint32_t begin, end;
+        geo_.getFigureRange(shape_pos_, begin, end);
+        if (begin == end)
+        {
+            return;
+        }
+        geometry_clip::relation rel = relate_figure(begin);
+        if (rel == geometry_clip::DISJOINT)
+        {
+            return;
+        }
         mapnik::geometry::line_string<double> line;
-        auto figures = geo_.getFiguresFromShape(shape_pos_);
+        read_figure(begin, line);
+        if (rel == geometry_clip::CROSSES)
+        {
+            rel = geometry_clip::relate(options_.clip_box, line);
+        }
+        if (rel == geometry_clip::INSIDE)
+        {
+            simplify(line, false);
+            parts.push_back(std::move(line));
+        }
+        else if (rel == geometry_clip::CROSSES)
+        {
+            std::size_t first = parts.size();
+            geometry_clip::clip_line(line, options_.clip_box, parts);
+            for (std::size_t i = first; i < parts.size(); ++i)
+            {
+                simplify(parts[i], false);
+            }
+        }
+    }
 
-        if (!figures.empty())
+    template <typename Line>
+    void read_figure(uint32_t figure_idx, Line& line)
+    {
+        // version 1 attributes describe rings, only version 2 has curves
+        mssqlclr::FIGURE attribute = geo_.getFigure(figure_idx).Attribute;
+        if (geo_.Version >= 2 && attribute == mssqlclr::FIGURE_V2_ARC)
+        {
+            read_arcs(figure_idx, line);
+        }
+        else if (geo_.Version >= 2 && attribute == mssqlclr::FIGURE_V2_COMPOSITE_CURVE)
         {
-            auto points = geo_.getPointsFromFigure(shape.FigureOffset);
+            read_composite(figure_idx, line);
+        }
+        else
+        {
+            read_points(figure_idx, line);
+        }
+    }
+
+  public:
+    mapnik_geoclr_reader(const char* data, std::size_t size, bool isGeography, geometry_decode_options const& options,
+                         geometry_simplify::simplifier* simplifier)
+        : geo_(mssqlclr::sqlgeo_reader(data, size).parseGeometry(isGeography)),
+          options_(options),
+          simplifier_(simplifier),
+          shape_pos_(0),
+          segment_pos_(0)
+    {
+    }
+
+    // the layout is validated up front, a rejected blob reads as empty
+    const char* error() const
+    {
+        return geo_.Error;
+    }
+
+    bool read_point(mapnik::geometry::point<double>& pt)
+    {
+        uint32_t begin, end;
+        geo_.getFigureRange(shape_pos_, begin, end);
+        if (begin == end)
+        {
+            return false;
+        }
+        uint32_t pt_begin, pt_end;
+        geo_.getPointRange(begin, pt_begin, pt_end);
+        if (pt_begin >= pt_end)
+        {
+            return false;
+        }
+        mssqlclr::Point p = geo_.getPoint(pt_begin);
+        pt.x = p.X;
+        pt.y = p.Y;
+        return true;
+    }
 
-            size_t num_points = points.size();
-            if (num_points > 0)
+    mapnik::geometry::multi_point<double> read_multipoint()
+    {
+        mapnik::geometry::multi_point<double> multi_point;
+        uint32_t parent_pos = shape_pos_;
+        multi_point.reserve(count_children(parent_pos));
+        while (is_child(shape_pos_ + 1, parent_pos))
+        {
+            shape_pos_++;
+            mapnik::geometry::point<double> pt;
+            if (read_point(pt))
             {
-                line.reserve(num_points);
-                for (auto p : points)
-                {
-                    line.emplace_back(p.X, p.Y);
-                }
+                multi_point.push_back(pt);
             }
         }
-        return line;
+        return multi_point;
     }
-    mapnik::geometry::multi_line_string<double> read_multilinestring(mssqlclr::Shape shape)
+
+    mapnik::geometry::line_string<double> read_linestring()
     {
+        mapnik::geometry::line_string<double> line;
+        uint32_t begin, end;
+        geo_.getFigureRange(shape_pos_, begin, end);
+        if (begin != end)
+        {
+            read_figure(begin, line);
+            simplify(line, false);
+        }
+        return line;
+    }
 
+    mapnik::geometry::multi_line_string<double> read_multilinestring()
+    {
         mapnik::geometry::multi_line_string<double> multi_line;
-
-        mssqlclr::Geometry parent_geo = geo_;
         uint32_t parent_pos = shape_pos_;
-        while ((parent_geo.Shapes.size() - 1 >= shape_pos_ + 1) && parent_geo.Shapes[shape_pos_ + 1].ParentOffset == parent_pos)
+        multi_line.reserve(count_children(parent_pos));
+        while (is_child(shape_pos_ + 1, parent_pos))
         {
             shape_pos_++;
-            multi_line.emplace_back(read_linestring(parent_geo.Shapes[shape_pos_]));
+            if (options_.clip)
+            {
+                read_line_parts(multi_line);
+            }
+            else
+            {
+                multi_line.emplace_back(read_linestring());
+            }
         }
-
         return multi_line;
     }
-    mapnik::geometry::polygon<double> read_polygon(mssqlclr::Shape shape)
+
+    // mapnik expects counterclockwise exterior rings and clockwise holes
+    void orient_ring(mapnik::geometry::linear_ring<double>& ring, bool exterior) const
+    {
+        if (geo_.IsGeography || options_.trust_orientation || ring.size() < 3)
+        {
+            return;
+        }
+        // shoelace, relative to the first vertex to keep precision
+        double x0 = ring[0].x;
+        double y0 = ring[0].y;
+        double area = 0;
+        for (std::size_t i = 1; i + 1 < ring.size(); ++i)
+        {
+            area += (ring[i].x - x0) * (ring[i + 1].y - y0) - (ring[i + 1].x - x0) * (ring[i].y - y0);
+        }
+        if (exterior ? area < 0 : area > 0)
+        {
+            std::reverse(ring.begin(), ring.end());
+        }
+    }
+
+    // compound curves consume segments, keep the segment cursor in sync
+    // when figures are not read
+    void skip_figures(uint32_t begin, uint32_t end)
     {
-        auto rings = geo_.getFiguresFromShape(shape_pos_);
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            if (geo_.Version >= 2 && geo_.getFigure(i).Attribute == mssqlclr::FIGURE_V2_COMPOSITE_CURVE)
+            {
+                do
+                {
+                    ++segment_pos_;
+                } while (segment_pos_ < geo_.NumSegments &&
+                         geo_.getSegment(segment_pos_) != mssqlclr::SEGMENT_FIRST_LINE &&
+                         geo_.getSegment(segment_pos_) != mssqlclr::SEGMENT_FIRST_ARC);
+            }
+        }
+    }
 
-        size_t num_rings = rings.size();
+    mapnik::geometry::polygon<double> read_polygon()
+    {
         mapnik::geometry::polygon<double> poly;
-        if (num_rings > 1)
+        uint32_t begin, end;
+        geo_.getFigureRange(shape_pos_, begin, end);
+        if (end - begin > 1)
         {
-            poly.interior_rings.reserve(num_rings - 1);
+            poly.interior_rings.reserve(end - begin - 1);
         }
 
-        for (int i = 0; i < num_rings; ++i)
+        for (uint32_t i = begin; i < end; ++i)
         {
-            mapnik::geometry::linear_ring<double> ring;
-            auto points = geo_.getPointsFromFigure(shape.FigureOffset + i);
-            size_t num_points = points.size();
-            if (num_points > 0)
+            if (i == begin)
             {
-                ring.reserve(num_points);
-                for (const auto& p : points)
+                read_ring(i, poly.exterior_ring);
+                if (poly.exterior_ring.empty() && options_.clip)
                 {
-                    ring.emplace_back(p.X, p.Y);
+                    // clipped away, holes are outside as well
+                    skip_figures(i + 1, end);
+                    break;
                 }
-            }
-            if (i == 0)
-            {
-                poly.set_exterior_ring(std::move(ring));
+                orient_ring(poly.exterior_ring, true);
             }
             else
             {
-                poly.add_hole(std::move(ring));
+                mapnik::geometry::linear_ring<double> ring;
+                read_ring(i, ring);
+                if (!ring.empty())
+                {
+                    orient_ring(ring, false);
+                    poly.add_hole(std::move(ring));
+                }
             }
         }
         return poly;
     }
-    mapnik::geometry::multi_polygon<double> read_multipolygon(mssqlclr::Shape shape)
-    {
 
+    mapnik::geometry::multi_polygon<double> read_multipolygon()
+    {
         mapnik::geometry::multi_polygon<double> multi_poly;
-        mssqlclr::Geometry parent_geo = geo_;
         uint32_t parent_pos = shape_pos_;
-        while ((parent_geo.Shapes.size() - 1 >= shape_pos_ + 1) && parent_geo.Shapes[shape_pos_ + 1].ParentOffset == parent_pos)
+        multi_poly.reserve(count_children(parent_pos));
+        while (is_child(shape_pos_ + 1, parent_pos))
         {
             shape_pos_++;
-            multi_poly.emplace_back(read_polygon(parent_geo.Shapes[shape_pos_]));
+            multi_poly.emplace_back(read_polygon());
+            if (multi_poly.back().exterior_ring.empty() && options_.clip)
+            {
+                multi_poly.pop_back();
+            }
         }
         return multi_poly;
     }
 
-    mapnik::geometry::geometry_collection<double> read_collection(mssqlclr::Shape shape)
+    mapnik::geometry::geometry_collection<double> read_collection()
     {
         mapnik::geometry::geometry_collection<double> collection;
-        mssqlclr::Geometry parent_geo = geo_;
         uint32_t parent_pos = shape_pos_;
-        while ((parent_geo.Shapes.size() - 1 >= shape_pos_ + 1) && parent_geo.Shapes[shape_pos_ + 1].ParentOffset == parent_pos)
+        while (is_child(shape_pos_ + 1, parent_pos))
         {
             shape_pos_++;
-            collection.push_back(std::move(read()));
+            mapnik::geometry::geometry<double> geom = read();
+            if (!options_.clip || !geom.is<mapnik::geometry::geometry_empty>())
+            {
+                collection.push_back(std::move(geom));
+            }
         }
-
         return collection;
     }
 
     mapnik::geometry::geometry<double> read()
     {
-        mapnik::geometry::geometry<double> geom = mapnik::geometry::geometry_empty();
-
-        if (geo_.Shapes.size() == 0)
+        if (geo_.NumShapes == 0)
         {
-            return geom;
+            return mapnik::geometry::geometry_empty();
         }
 
-        auto s = geo_.Shapes[shape_pos_];
-
-        mssqlclr::SHAPE type = s.OpenGisType;
+        mssqlclr::SHAPE type = geo_.getShape(shape_pos_).OpenGisType;
         switch (type)
         {
         case mssqlclr::SHAPE::SHAPE_POINT:
-            geom = std::move(read_point(s));
+        {
+            mapnik::geometry::point<double> pt;
+            if (read_point(pt))
+            {
+                return pt;
+            }
             break;
+        }
         case mssqlclr::SHAPE::SHAPE_LINESTRING:
-            geom = std::move(read_linestring(s));
+        case mssqlclr::SHAPE::SHAPE_CIRCULAR_STRING:
+        case mssqlclr::SHAPE::SHAPE_COMPOUND_CURVE:
+        {
+            if (!options_.clip)
+            {
+                return read_linestring();
+            }
+            // a clipped line may be split in several parts
+            mapnik::geometry::multi_line_string<double> parts;
+            read_line_parts(parts);
+            if (parts.size() == 1)
+            {
+                return std::move(parts.front());
+            }
+            if (parts.size() > 1)
+            {
+                return std::move(parts);
+            }
             break;
+        }
         case mssqlclr::SHAPE::SHAPE_POLYGON:
-            geom = std::move(read_polygon(s));
+        case mssqlclr::SHAPE::SHAPE_CURVE_POLYGON:
+        {
+            mapnik::geometry::polygon<double> poly = read_polygon();
+            if (!poly.exterior_ring.empty() || !options_.clip)
+            {
+                return std::move(poly);
+            }
             break;
+        }
         case mssqlclr::SHAPE::SHAPE_MULTIPOINT:
-            geom = std::move(read_multipoint(s));
-            break;
+            return read_multipoint();
+        // every part may be clipped away, the geometry is then empty and
+        // dropped from a collection
         case mssqlclr::SHAPE::SHAPE_MULTILINESTRING:
-            geom = std::move(read_multilinestring(s));
+        {
+            mapnik::geometry::multi_line_string<double> multi_line = read_multilinestring();
+            if (!multi_line.empty() || !options_.clip)
+            {
+                return std::move(multi_line);
+            }
             break;
+        }
         case mssqlclr::SHAPE::SHAPE_MULTIPOLYGON:
-            geom = std::move(read_multipolygon(s));
+        {
+            mapnik::geometry::multi_polygon<double> multi_poly = read_multipolygon();
+            if (!multi_poly.empty() || !options_.clip)
+            {
+                return std::move(multi_poly);
+            }
             break;
+        }
         case mssqlclr::SHAPE::SHAPE_GEOMETRY_COLLECTION:
-            geom = std::move(read_collection(s));
+        {
+            mapnik::geometry::geometry_collection<double> collection = read_collection();
+            if (!collection.empty() || !options_.clip)
+            {
+                return std::move(collection);
+            }
             break;
-
-        case mssqlclr::SHAPE::SHAPE_COMPOUND_CURVE:
-        case mssqlclr::SHAPE::SHAPE_CIRCULAR_STRING:
-        case mssqlclr::SHAPE::SHAPE_CURVE_POLYGON:
+        }
         default:
-            //nope
             break;
         }
 
-        return geom;
+        return mapnik::geometry::geometry_empty();
     }
 };
 
-mapnik::geometry::geometry<double> from_geoclr(const char* data,
-                                               std::size_t size, bool is_geography)
+inline mapnik::geometry::geometry<double> from_geoclr(const char* data,
+                                                      std::size_t size, bool is_geography,
+                                                      geometry_decode_options const& options = geometry_decode_options(),
+                                                      geometry_simplify::simplifier* simplifier = nullptr)
 {
     if (size == 0)
     {
         return mapnik::geometry::geometry_empty();
     }
-    mapnik_geoclr_reader reader(data, size, is_geography);
-    mapnik::geometry::geometry<double> geom(reader.read());
-    // note: this will only be applied to polygons
-    mapnik::geometry::correct(geom);
-    return geom;
+    mapnik_geoclr_reader reader(data, size, is_geography, options, simplifier);
+    if (reader.error())
+    {
+        MAPNIK_LOG_WARN(mssql) << "mssql_featureset: invalid geometry blob: " << reader.error();
+        return mapnik::geometry::geometry_empty();
+    }
+    // rings are closed and oriented by the reader, no need for geometry::correct
+    return reader.read();
 }
 
-#endif //MSSQL_GEOCLR_READER_HPP
\ No newline at end of file
+#endif //MSSQL_GEOCLR_READER_HPP
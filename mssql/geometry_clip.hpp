@@ -0,0 +1,395 @@
+#ifndef MSSQL_GEOMETRY_CLIP_HPP
+#define MSSQL_GEOMETRY_CLIP_HPP
+
+#include <mapnik/box2d.hpp>
+#include <mapnik/geometry.hpp>
+
+#include <cstddef>
+#include <utility>
+
+// Clipping of decoded geometries to the (buffered) query box, so the renderer
+// does not have to process vertices it would clip away anyway.
+// Points are never clipped, the server filter already selected them.
+namespace geometry_clip {
+
+enum relation
+{
+    DISJOINT,
+    INSIDE,
+    CROSSES
+};
+
+inline relation relate(mapnik::box2d<double> const& box, double minx, double miny, double maxx, double maxy)
+{
+    if (maxx < box.minx() || minx > box.maxx() || maxy < box.miny() || miny > box.maxy())
+    {
+        return DISJOINT;
+    }
+    if (minx >= box.minx() && maxx <= box.maxx() && miny >= box.miny() && maxy <= box.maxy())
+    {
+        return INSIDE;
+    }
+    return CROSSES;
+}
+
+template <typename Line>
+relation relate(mapnik::box2d<double> const& box, Line const& line)
+{
+    if (line.empty())
+    {
+        return DISJOINT;
+    }
+    double minx = line[0].x, maxx = minx;
+    double miny = line[0].y, maxy = miny;
+    for (auto const& pt : line)
+    {
+        minx = pt.x < minx ? pt.x : minx;
+        maxx = pt.x > maxx ? pt.x : maxx;
+        miny = pt.y < miny ? pt.y : miny;
+        maxy = pt.y > maxy ? pt.y : maxy;
+    }
+    return relate(box, minx, miny, maxx, maxy);
+}
+
+namespace detail {
+
+// box edges: 0 x >= minx, 1 x <= maxx, 2 y >= miny, 3 y <= maxy
+inline bool inside(mapnik::geometry::point<double> const& pt, int edge, double value)
+{
+    switch (edge)
+    {
+    case 0:
+        return pt.x >= value;
+    case 1:
+        return pt.x <= value;
+    case 2:
+        return pt.y >= value;
+    default:
+        return pt.y <= value;
+    }
+}
+
+inline mapnik::geometry::point<double> intersection(mapnik::geometry::point<double> const& a,
+                                                     mapnik::geometry::point<double> const& b,
+                                                     int edge, double value)
+{
+    if (edge < 2)
+    {
+        double t = (value - a.x) / (b.x - a.x);
+        return mapnik::geometry::point<double>(value, a.y + t * (b.y - a.y));
+    }
+    double t = (value - a.y) / (b.y - a.y);
+    return mapnik::geometry::point<double>(a.x + t * (b.x - a.x), value);
+}
+
+// an intersection on a vertex would repeat it
+template <typename Ring>
+void push_distinct(Ring& ring, mapnik::geometry::point<double> const& pt)
+{
+    if (ring.empty() || ring.back().x != pt.x || ring.back().y != pt.y)
+    {
+        ring.push_back(pt);
+    }
+}
+
+// one Sutherland-Hodgman pass over an open ring, a ring only touching the
+// edge is left with fewer than 3 vertices
+template <typename Ring>
+void clip_edge(Ring const& in, Ring& out, int edge, double value)
+{
+    out.clear();
+    if (in.empty())
+    {
+        return;
+    }
+    mapnik::geometry::point<double> prev = in.back();
+    bool prev_inside = inside(prev, edge, value);
+    for (auto const& pt : in)
+    {
+        bool pt_inside = inside(pt, edge, value);
+        if (pt_inside != prev_inside)
+        {
+            push_distinct(out, intersection(prev, pt, edge, value));
+        }
+        if (pt_inside)
+        {
+            push_distinct(out, pt);
+        }
+        prev = pt;
+        prev_inside = pt_inside;
+    }
+    if (out.size() > 1 && out.front().x == out.back().x && out.front().y == out.back().y)
+    {
+        out.pop_back();
+    }
+}
+
+// Liang-Barsky, narrows [t0, t1] to the part of a->b inside the box
+inline bool clip_segment(mapnik::geometry::point<double> const& a, mapnik::geometry::point<double> const& b,
+                         mapnik::box2d<double> const& box, double& t0, double& t1)
+{
+    double dx = b.x - a.x;
+    double dy = b.y - a.y;
+    double p[4] = { -dx, dx, -dy, dy };
+    double q[4] = { a.x - box.minx(), box.maxx() - a.x, a.y - box.miny(), box.maxy() - a.y };
+    t0 = 0;
+    t1 = 1;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (p[i] == 0)
+        {
+            if (q[i] < 0)
+            {
+                return false;
+            }
+            continue;
+        }
+        double t = q[i] / p[i];
+        if (p[i] < 0)
+        {
+            if (t > t1)
+            {
+                return false;
+            }
+            t0 = t > t0 ? t : t0;
+        }
+        else
+        {
+            if (t < t0)
+            {
+                return false;
+            }
+            t1 = t < t1 ? t : t1;
+        }
+    }
+    return true;
+}
+
+inline mapnik::geometry::point<double> lerp(mapnik::geometry::point<double> const& a,
+                                             mapnik::geometry::point<double> const& b, double t)
+{
+    return mapnik::geometry::point<double>(a.x + t * (b.x - a.x), a.y + t * (b.y - a.y));
+}
+
+} // namespace detail
+
+// Clips a closed ring in place, the ring is left empty when nothing remains.
+// The result may have edges running along the box, which is fine for rendering.
+inline void clip_ring(mapnik::geometry::linear_ring<double>& ring, mapnik::box2d<double> const& box)
+{
+    if (ring.size() > 1 && ring.front().x == ring.back().x && ring.front().y == ring.back().y)
+    {
+        ring.pop_back();
+    }
+    mapnik::geometry::linear_ring<double> scratch;
+    scratch.reserve(ring.size() + 4);
+    detail::clip_edge(ring, scratch, 0, box.minx());
+    detail::clip_edge(scratch, ring, 1, box.maxx());
+    detail::clip_edge(ring, scratch, 2, box.miny());
+    detail::clip_edge(scratch, ring, 3, box.maxy());
+    if (ring.size() < 3)
+    {
+        ring.clear();
+        return;
+    }
+    ring.push_back(ring.front());
+}
+
+// Appends the parts of line inside the box to parts
+template <typename Parts>
+void clip_line(mapnik::geometry::line_string<double> const& line, mapnik::box2d<double> const& box, Parts& parts)
+{
+    mapnik::geometry::line_string<double> current;
+    for (std::size_t i = 1; i < line.size(); ++i)
+    {
+        double t0, t1;
+        if (!detail::clip_segment(line[i - 1], line[i], box, t0, t1))
+        {
+            if (current.size() > 1)
+            {
+                parts.push_back(std::move(current));
+            }
+            current.clear();
+            continue;
+        }
+        if (current.empty() || t0 > 0)
+        {
+            if (current.size() > 1)
+            {
+                parts.push_back(std::move(current));
+            }
+            current.clear();
+            current.push_back(t0 > 0 ? detail::lerp(line[i - 1], line[i], t0) : line[i - 1]);
+        }
+        current.push_back(t1 < 1 ? detail::lerp(line[i - 1], line[i], t1) : line[i]);
+        if (t1 < 1)
+        {
+            parts.push_back(std::move(current));
+            current.clear();
+        }
+    }
+    if (current.size() > 1)
+    {
+        parts.push_back(std::move(current));
+    }
+}
+
+// Clips the exterior ring and holes of poly, returns false when nothing remains
+inline bool clip_polygon(mapnik::geometry::polygon<double>& poly, mapnik::box2d<double> const& box)
+{
+    relation rel = relate(box, poly.exterior_ring);
+    if (rel == DISJOINT)
+    {
+        return false;
+    }
+    if (rel == CROSSES)
+    {
+        clip_ring(poly.exterior_ring, box);
+        if (poly.exterior_ring.empty())
+        {
+            return false;
+        }
+    }
+    std::size_t kept = 0;
+    for (auto& hole : poly.interior_rings)
+    {
+        rel = relate(box, hole);
+        if (rel == CROSSES)
+        {
+            clip_ring(hole, box);
+        }
+        if (rel != DISJOINT && !hole.empty())
+        {
+            if (&poly.interior_rings[kept] != &hole)
+            {
+                poly.interior_rings[kept] = std::move(hole);
+            }
+            ++kept;
+        }
+    }
+    poly.interior_rings.resize(kept);
+    return true;
+}
+
+// Clips an already decoded geometry, used for WKB which is decoded by mapnik
+struct clip_visitor
+{
+    explicit clip_visitor(mapnik::box2d<double> const& box)
+        : box_(box) {}
+
+    mapnik::geometry::geometry<double> operator()(mapnik::geometry::geometry_empty& geom) const
+    {
+        return geom;
+    }
+
+    mapnik::geometry::geometry<double> operator()(mapnik::geometry::point<double>& geom) const
+    {
+        return geom;
+    }
+
+    mapnik::geometry::geometry<double> operator()(mapnik::geometry::multi_point<double>& geom) const
+    {
+        return std::move(geom);
+    }
+
+    mapnik::geometry::geometry<double> operator()(mapnik::geometry::line_string<double>& geom) const
+    {
+        relation rel = relate(box_, geom);
+        if (rel == INSIDE)
+        {
+            return std::move(geom);
+        }
+        mapnik::geometry::multi_line_string<double> parts;
+        if (rel == CROSSES)
+        {
+            clip_line(geom, box_, parts);
+        }
+        if (parts.empty())
+        {
+            return mapnik::geometry::geometry_empty();
+        }
+        if (parts.size() == 1)
+        {
+            return std::move(parts.front());
+        }
+        return std::move(parts);
+    }
+
+    mapnik::geometry::geometry<double> operator()(mapnik::geometry::multi_line_string<double>& geom) const
+    {
+        mapnik::geometry::multi_line_string<double> parts;
+        for (auto& line : geom)
+        {
+            relation rel = relate(box_, line);
+            if (rel == INSIDE)
+            {
+                parts.push_back(std::move(line));
+            }
+            else if (rel == CROSSES)
+            {
+                clip_line(line, box_, parts);
+            }
+        }
+        if (parts.empty())
+        {
+            return mapnik::geometry::geometry_empty();
+        }
+        return std::move(parts);
+    }
+
+    mapnik::geometry::geometry<double> operator()(mapnik::geometry::polygon<double>& geom) const
+    {
+        if (!clip_polygon(geom, box_))
+        {
+            return mapnik::geometry::geometry_empty();
+        }
+        return std::move(geom);
+    }
+
+    mapnik::geometry::geometry<double> operator()(mapnik::geometry::multi_polygon<double>& geom) const
+    {
+        mapnik::geometry::multi_polygon<double> parts;
+        for (auto& poly : geom)
+        {
+            if (clip_polygon(poly, box_))
+            {
+                parts.push_back(std::move(poly));
+            }
+        }
+        if (parts.empty())
+        {
+            return mapnik::geometry::geometry_empty();
+        }
+        return std::move(parts);
+    }
+
+    mapnik::geometry::geometry<double> operator()(mapnik::geometry::geometry_collection<double>& geom) const
+    {
+        mapnik::geometry::geometry_collection<double> members;
+        for (auto& member : geom)
+        {
+            mapnik::geometry::geometry<double> clipped = mapnik::util::apply_visitor(*this, member);
+            if (!clipped.is<mapnik::geometry::geometry_empty>())
+            {
+                members.push_back(std::move(clipped));
+            }
+        }
+        if (members.empty())
+        {
+            return mapnik::geometry::geometry_empty();
+        }
+        return std::move(members);
+    }
+
+  private:
+    mapnik::box2d<double> const& box_;
+};
+
+inline mapnik::geometry::geometry<double> clip(mapnik::geometry::geometry<double>&& geom, mapnik::box2d<double> const& box)
+{
+    return mapnik::util::apply_visitor(clip_visitor(box), geom);
+}
+
+} // namespace geometry_clip
+
+#endif // MSSQL_GEOMETRY_CLIP_HPP
@@ -0,0 +1,338 @@
+#ifndef MSSQL_GEOMETRY_SIMPLIFY_HPP
+#define MSSQL_GEOMETRY_SIMPLIFY_HPP
+
+#include <mapnik/geometry.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// Client side simplification of decoded lines and rings, an alternative to
+// running .Reduce() on the server.
+namespace geometry_simplify {
+
+enum algorithm
+{
+    NONE,
+    SNAP,            // snap to a grid of tolerance and drop repeated vertices
+    DOUGLAS_PEUCKER, // max distance to the simplified line is tolerance
+    VISVALINGAM      // drop vertices whose effective area is under tolerance^2
+};
+
+// Simplifies lines in place. The scratch buffers are kept between calls so a
+// featureset does not allocate for each geometry.
+class simplifier
+{
+  public:
+    simplifier(algorithm algo, double tolerance)
+        : algorithm_(algo),
+          tolerance_(tolerance) {}
+
+    algorithm get_algorithm() const
+    {
+        return algorithm_;
+    }
+
+    // Rings stay closed with at least 4 vertices and lines keep their end
+    // points. A ring that would collapse keeps its first vertex and the two
+    // farthest from it.
+    template <typename Line>
+    void apply(Line& line, bool ring)
+    {
+        std::size_t min_points = ring ? 4 : 2;
+        if (algorithm_ == NONE || tolerance_ <= 0 || line.size() <= min_points)
+        {
+            return;
+        }
+        out_.clear();
+        switch (algorithm_)
+        {
+        case SNAP:
+            snap(line);
+            break;
+        case DOUGLAS_PEUCKER:
+            douglas_peucker(line);
+            break;
+        case VISVALINGAM:
+            visvalingam(line, min_points);
+            break;
+        default:
+            return;
+        }
+        if (ring && out_.size() < min_points)
+        {
+            minimal_ring(line);
+        }
+        if (out_.size() >= min_points)
+        {
+            line.assign(out_.begin(), out_.end());
+        }
+    }
+
+    // Simplifies every line and ring of an already decoded geometry (WKB)
+    void apply(mapnik::geometry::geometry<double>& geom)
+    {
+        if (algorithm_ != NONE)
+        {
+            mapnik::util::apply_visitor(visitor(*this), geom);
+        }
+    }
+
+  private:
+    typedef mapnik::geometry::point<double> point_type;
+
+    algorithm algorithm_;
+    double tolerance_;
+    std::vector<point_type> out_;
+    std::vector<char> keep_;
+    std::vector<std::pair<uint32_t, uint32_t>> stack_;
+    std::vector<uint32_t> prev_;
+    std::vector<uint32_t> next_;
+    std::vector<double> area_;
+    std::vector<std::pair<double, uint32_t>> heap_;
+
+    struct visitor
+    {
+        explicit visitor(simplifier& s)
+            : s_(s) {}
+
+        void operator()(mapnik::geometry::geometry_empty&) const {}
+        void operator()(mapnik::geometry::point<double>&) const {}
+        void operator()(mapnik::geometry::multi_point<double>&) const {}
+
+        void operator()(mapnik::geometry::line_string<double>& line) const
+        {
+            s_.apply(line, false);
+        }
+
+        void operator()(mapnik::geometry::polygon<double>& poly) const
+        {
+            s_.apply(poly.exterior_ring, true);
+            for (auto& hole : poly.interior_rings)
+            {
+                s_.apply(hole, true);
+            }
+        }
+
+        void operator()(mapnik::geometry::multi_line_string<double>& multi_line) const
+        {
+            for (auto& line : multi_line)
+            {
+                (*this)(line);
+            }
+        }
+
+        void operator()(mapnik::geometry::multi_polygon<double>& multi_poly) const
+        {
+            for (auto& poly : multi_poly)
+            {
+                (*this)(poly);
+            }
+        }
+
+        void operator()(mapnik::geometry::geometry_collection<double>& collection) const
+        {
+            for (auto& geom : collection)
+            {
+                mapnik::util::apply_visitor(*this, geom);
+            }
+        }
+
+        simplifier& s_;
+    };
+
+    template <typename Line>
+    void snap(Line const& line)
+    {
+        for (auto const& pt : line)
+        {
+            point_type snapped(std::round(pt.x / tolerance_) * tolerance_, std::round(pt.y / tolerance_) * tolerance_);
+            if (out_.empty() || out_.back().x != snapped.x || out_.back().y != snapped.y)
+            {
+                out_.push_back(snapped);
+            }
+        }
+    }
+
+    // the first vertex, the one farthest from it and the one farthest from
+    // both, in ring order so that the orientation is kept
+    template <typename Line>
+    void minimal_ring(Line const& line)
+    {
+        uint32_t last = uint32_t(line.size()) - 1; // the closing vertex
+        uint32_t far = 1;
+        double max_distance2 = -1;
+        for (uint32_t i = 1; i < last; ++i)
+        {
+            double d = segment_distance2(line[i], line[0], line[0]);
+            if (d > max_distance2)
+            {
+                max_distance2 = d;
+                far = i;
+            }
+        }
+        uint32_t third = far == 1 ? 2 : 1;
+        max_distance2 = -1;
+        for (uint32_t i = 1; i < last; ++i)
+        {
+            double d = segment_distance2(line[i], line[0], line[far]);
+            if (i != far && d > max_distance2)
+            {
+                max_distance2 = d;
+                third = i;
+            }
+        }
+        out_.clear();
+        out_.push_back(line[0]);
+        out_.push_back(line[std::min(far, third)]);
+        out_.push_back(line[std::max(far, third)]);
+        out_.push_back(line[0]);
+    }
+
+    // squared distance from p to the segment a b
+    static double segment_distance2(point_type const& p, point_type const& a, point_type const& b)
+    {
+        double dx = b.x - a.x;
+        double dy = b.y - a.y;
+        double px = p.x - a.x;
+        double py = p.y - a.y;
+        double length2 = dx * dx + dy * dy;
+        if (length2 > 0)
+        {
+            double t = (px * dx + py * dy) / length2;
+            t = t < 0 ? 0 : (t > 1 ? 1 : t);
+            px -= t * dx;
+            py -= t * dy;
+        }
+        return px * px + py * py;
+    }
+
+    // iterative, the first split of a closed ring is on its farthest vertex
+    // from the start since the base segment is a single point
+    template <typename Line>
+    void douglas_peucker(Line const& line)
+    {
+        uint32_t n = uint32_t(line.size());
+        double tolerance2 = tolerance_ * tolerance_;
+        keep_.assign(n, 0);
+        keep_[0] = keep_[n - 1] = 1;
+        stack_.clear();
+        stack_.emplace_back(0, n - 1);
+        while (!stack_.empty())
+        {
+            uint32_t first = stack_.back().first;
+            uint32_t last = stack_.back().second;
+            stack_.pop_back();
+
+            double max_distance2 = 0;
+            uint32_t farthest = first;
+            for (uint32_t i = first + 1; i < last; ++i)
+            {
+                double d = segment_distance2(line[i], line[first], line[last]);
+                if (d > max_distance2)
+                {
+                    max_distance2 = d;
+                    farthest = i;
+                }
+            }
+            if (max_distance2 > tolerance2)
+            {
+                keep_[farthest] = 1;
+                stack_.emplace_back(first, farthest);
+                stack_.emplace_back(farthest, last);
+            }
+        }
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            if (keep_[i])
+            {
+                out_.push_back(line[i]);
+            }
+        }
+    }
+
+    template <typename Line>
+    double triangle_area(Line const& line, uint32_t i) const
+    {
+        point_type const& a = line[prev_[i]];
+        point_type const& b = line[i];
+        point_type const& c = line[next_[i]];
+        return std::fabs((b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y)) / 2;
+    }
+
+    // min-heap of effective areas with lazy deletion of stale entries
+    template <typename Line>
+    void visvalingam(Line const& line, std::size_t min_points)
+    {
+        typedef std::greater<std::pair<double, uint32_t>> heap_order;
+        uint32_t n = uint32_t(line.size());
+        double threshold = tolerance_ * tolerance_;
+        prev_.resize(n);
+        next_.resize(n);
+        area_.assign(n, 0);
+        keep_.assign(n, 1);
+        heap_.clear();
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            prev_[i] = i - 1;
+            next_[i] = i + 1;
+        }
+        for (uint32_t i = 1; i + 1 < n; ++i)
+        {
+            area_[i] = triangle_area(line, i);
+            heap_.emplace_back(area_[i], i);
+        }
+        std::make_heap(heap_.begin(), heap_.end(), heap_order());
+
+        std::size_t remaining = n;
+        while (!heap_.empty() && remaining > min_points)
+        {
+            std::pop_heap(heap_.begin(), heap_.end(), heap_order());
+            double area = heap_.back().first;
+            uint32_t i = heap_.back().second;
+            heap_.pop_back();
+            if (!keep_[i] || area != area_[i])
+            {
+                continue;
+            }
+            if (area >= threshold)
+            {
+                break;
+            }
+            keep_[i] = 0;
+            --remaining;
+            uint32_t p = prev_[i];
+            uint32_t q = next_[i];
+            next_[p] = q;
+            prev_[q] = p;
+            // neighbours never get a smaller area than the vertex just removed
+            if (p > 0)
+            {
+                area_[p] = std::max(triangle_area(line, p), area);
+                heap_.emplace_back(area_[p], p);
+                std::push_heap(heap_.begin(), heap_.end(), heap_order());
+            }
+            if (q + 1 < n)
+            {
+                area_[q] = std::max(triangle_area(line, q), area);
+                heap_.emplace_back(area_[q], q);
+                std::push_heap(heap_.begin(), heap_.end(), heap_order());
+            }
+        }
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            if (keep_[i])
+            {
+                out_.push_back(line[i]);
+            }
+        }
+    }
+};
+
+} // namespace geometry_simplify
+
+#endif // MSSQL_GEOMETRY_SIMPLIFY_HPP
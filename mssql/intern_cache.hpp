@@ -0,0 +1,74 @@
+#ifndef MSSQL_INTERN_CACHE_HPP
+#define MSSQL_INTERN_CACHE_HPP
+
+#include <mapnik/value_types.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+// String attribute values already built for one column, keyed by the raw
+// bytes read from the driver, so repeated values are transcoded once. Stops
+// growing at max_entries: a column of unique values then only costs a hash
+// lookup per row.
+class intern_cache
+{
+  public:
+    explicit intern_cache(std::size_t max_entries)
+        : max_entries_(max_entries) {}
+
+    // build() makes the value for bytes that are not cached yet
+    template <typename Build>
+    mapnik::value_unicode_string const& get(const char* data, std::size_t size, Build build)
+    {
+        std::size_t hash = hash_bytes(data, size);
+        auto range = entries_.equal_range(hash);
+        for (auto itr = range.first; itr != range.second; ++itr)
+        {
+            std::string const& bytes = itr->second.bytes;
+            if (bytes.size() == size && (size == 0 || std::memcmp(bytes.data(), data, size) == 0))
+            {
+                return itr->second.value;
+            }
+        }
+
+        if (entries_.size() >= max_entries_)
+        {
+            uncached_ = build();
+            return uncached_;
+        }
+        auto itr = entries_.emplace(hash, entry{std::string(data, size), build()});
+        return itr->second.value;
+    }
+
+    std::size_t size() const
+    {
+        return entries_.size();
+    }
+
+  private:
+    struct entry
+    {
+        std::string bytes;
+        mapnik::value_unicode_string value;
+    };
+
+    // FNV-1a
+    static std::size_t hash_bytes(const char* data, std::size_t size)
+    {
+        std::uint64_t hash = 14695981039346656037ULL;
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ULL;
+        }
+        return static_cast<std::size_t>(hash);
+    }
+
+    const std::size_t max_entries_;
+    std::unordered_multimap<std::size_t, entry> entries_;
+    mapnik::value_unicode_string uncached_;
+};
+
+#endif // MSSQL_INTERN_CACHE_HPP
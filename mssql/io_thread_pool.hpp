@@ -0,0 +1,152 @@
+#ifndef MSSQL_IO_THREAD_POOL_HPP
+#define MSSQL_IO_THREAD_POOL_HPP
+
+#include <mapnik/util/noncopyable.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifndef _WINDOWS
+#include <pthread.h>
+#endif
+
+// Threads running blocking ODBC calls, so that the queries of several layers
+// are executed by the server at the same time. The tasks still queued when
+// the pool is destroyed are run: a connection may be waiting for one. A
+// forked process starts its own threads, those of the parent are gone.
+class io_thread_pool : private mapnik::util::noncopyable
+{
+  public:
+    explicit io_thread_pool(unsigned threads)
+        : size_(std::max(threads, 1u)),
+          workers_(new workers())
+    {
+#ifndef _WINDOWS
+        static const int atfork = pthread_atfork(&io_thread_pool::before_fork, &io_thread_pool::after_fork_parent,
+                                                 &io_thread_pool::after_fork_child);
+        (void)atfork;
+#endif
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry().insert(this);
+    }
+
+    ~io_thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            registry().erase(this);
+        }
+        {
+            std::lock_guard<std::mutex> lock(workers_->mutex);
+            workers_->stop = true;
+        }
+        workers_->ready.notify_all();
+        for (auto& thread : workers_->threads)
+        {
+            thread.join();
+        }
+    }
+
+    template <typename F>
+    std::future<typename std::result_of<F()>::type> submit(F task)
+    {
+        using result_type = typename std::result_of<F()>::type;
+        auto packaged = std::make_shared<std::packaged_task<result_type()>>(std::move(task));
+        std::future<result_type> result = packaged->get_future();
+        workers* w = workers_.get();
+        {
+            std::lock_guard<std::mutex> lock(w->mutex);
+            // started on first use, most datasources never query asynchronously
+            while (w->threads.size() < size_)
+            {
+                w->threads.emplace_back(&io_thread_pool::run, w);
+            }
+            w->tasks.emplace_back([packaged]() { (*packaged)(); });
+        }
+        w->ready.notify_one();
+        return result;
+    }
+
+  private:
+    struct workers
+    {
+        workers()
+            : stop(false)
+        {
+        }
+
+        bool stop;
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::function<void()>> tasks;
+        std::vector<std::thread> threads;
+    };
+
+    static std::mutex& registry_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::set<io_thread_pool*>& registry()
+    {
+        static std::set<io_thread_pool*> pools;
+        return pools;
+    }
+
+    static void before_fork()
+    {
+        registry_mutex().lock();
+    }
+
+    static void after_fork_parent()
+    {
+        registry_mutex().unlock();
+    }
+
+    // the threads of the parent are gone: their mutex may be held and their
+    // condition variable waited on, the queued tasks are for the connections
+    // of the parent. All is replaced, the old state is never destroyed.
+    static void after_fork_child()
+    {
+        for (io_thread_pool* pool : registry())
+        {
+            pool->workers_.release(); // leaked on purpose
+            pool->workers_.reset(new workers());
+        }
+        registry_mutex().unlock();
+    }
+
+    static void run(workers* w)
+    {
+        for (;;)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(w->mutex);
+                w->ready.wait(lock, [w]() { return w->stop || !w->tasks.empty(); });
+                if (w->tasks.empty())
+                {
+                    return;
+                }
+                task = std::move(w->tasks.front());
+                w->tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    const unsigned size_;
+    std::unique_ptr<workers> workers_;
+};
+
+#endif // MSSQL_IO_THREAD_POOL_HPP
@@ -0,0 +1,198 @@
+#ifndef MSSQL_MPMC_QUEUE_HPP
+#define MSSQL_MPMC_QUEUE_HPP
+
+#include <mapnik/util/noncopyable.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// Bounded multi-producer multi-consumer queue (Dmitry Vyukov's design): each
+// cell carries a sequence number telling whether it can be written or read
+// for a given lap, so push and pop only contend on their own position.
+template <typename T>
+class mpmc_queue : private mapnik::util::noncopyable
+{
+  public:
+    // capacity is rounded up to a power of two
+    explicit mpmc_queue(std::size_t capacity)
+        : mask_(round_up(capacity) - 1),
+          cells_(new cell[mask_ + 1]),
+          enqueue_pos_(0),
+          dequeue_pos_(0)
+    {
+        for (std::size_t i = 0; i <= mask_; ++i)
+        {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    std::size_t capacity() const
+    {
+        return mask_ + 1;
+    }
+
+    // value is only moved from when the push succeeds
+    bool try_push(T&& value)
+    {
+        cell* c;
+        std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            c = &cells_[pos & mask_];
+            std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            std::intptr_t diff = std::intptr_t(seq) - std::intptr_t(pos);
+            if (diff == 0)
+            {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        c->value = std::move(value);
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value)
+    {
+        cell* c;
+        std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            c = &cells_[pos & mask_];
+            std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            std::intptr_t diff = std::intptr_t(seq) - std::intptr_t(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // empty
+            }
+            else
+            {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(c->value);
+        c->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+  private:
+    struct cell
+    {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    static std::size_t round_up(std::size_t n)
+    {
+        std::size_t size = 2;
+        while (size < n)
+        {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    // producers and consumers on separate cache lines
+    const std::size_t mask_;
+    const std::unique_ptr<cell[]> cells_;
+    char pad0_[64];
+    std::atomic<std::size_t> enqueue_pos_;
+    char pad1_[64];
+    std::atomic<std::size_t> dequeue_pos_;
+    char pad2_[64];
+};
+
+// Lets a pipeline stage sleep until another one changes what it waits for,
+// after a short spin: a wait can last as long as a network round trip. The
+// condition is checked again once the waiter is registered, so a notify()
+// racing with it is never lost, and notify() only takes the mutex when a
+// thread sleeps.
+class event_count : private mapnik::util::noncopyable
+{
+  public:
+    event_count()
+        : epoch_(0),
+          waiters_(0) {}
+
+    // returns once ready() holds
+    template <typename Ready>
+    void await(Ready ready)
+    {
+        for (unsigned i = 0; i < 64; ++i)
+        {
+            if (ready())
+            {
+                return;
+            }
+            std::this_thread::yield();
+        }
+        for (;;)
+        {
+            waiters_.fetch_add(1);
+            unsigned epoch = epoch_.load();
+            if (ready())
+            {
+                waiters_.fetch_sub(1);
+                return;
+            }
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [this, epoch]() { return epoch_.load() != epoch; });
+            }
+            waiters_.fetch_sub(1);
+        }
+    }
+
+    // after making ready() true for one waiter
+    void notify_one()
+    {
+        epoch_.fetch_add(1);
+        if (waiters_.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            changed_.notify_one();
+        }
+    }
+
+    // after making ready() true for every waiter
+    void notify_all()
+    {
+        epoch_.fetch_add(1);
+        if (waiters_.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            changed_.notify_all();
+        }
+    }
+
+  private:
+    std::atomic<unsigned> epoch_;
+    std::atomic<unsigned> waiters_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+};
+
+#endif // MSSQL_MPMC_QUEUE_HPP
@@ -27,6 +27,8 @@
 #include "cursorresultset.hpp"
 #include "mssql_datasource.hpp"
 #include "mssql_featureset.hpp"
+#include "mssql_pipelined_featureset.hpp"
+#include "readaheadresultset.hpp"
 #include "resultset.hpp"
 
 // mapnik
@@ -45,11 +47,13 @@
 
 // stl
 #include <algorithm>
+#include <chrono>
 #include <iomanip>
 #include <memory>
 #include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 
 DATASOURCE_PLUGIN(mssql_datasource)
 
@@ -74,6 +78,8 @@ mssql_datasource::mssql_datasource(parameters const& params)
       srid_(*params.get<mapnik::value_integer>("srid", 0)),
       extent_initialized_(false),
       simplify_geometries_(false),
+      simplify_algorithm_(geometry_simplify::NONE),
+      simplify_tolerance_(*params.get<mapnik::value_double>("simplify_tolerance", 0.5)),
       desc_(mssql_datasource::name(), "utf-8"),
       odbc_instance_(Odbc::getInstance()),
       creator_(odbc_instance_, 
@@ -101,7 +107,18 @@ mssql_datasource::mssql_datasource(parameters const& params)
 
       wkb_(*params.get<mapnik::boolean_type>("wkb", false)),
       use_filter_(*params.get<mapnik::boolean_type>("use_filter", false)),
-      trace_flag_4199_(*params.get<mapnik::boolean_type>("trace_flag_4199", false))
+      hybrid_filter_(*params.get<mapnik::boolean_type>("hybrid_filter", false)),
+      trace_flag_4199_(*params.get<mapnik::boolean_type>("trace_flag_4199", false)),
+      arc_tolerance_(*params.get<mapnik::value_double>("arc_tolerance", 0.25)),
+      clip_geometries_(*params.get<mapnik::boolean_type>("clip_geometries", false)),
+      clip_buffer_(*params.get<mapnik::value_double>("clip_buffer", 64)),
+      pipeline_threads_(*params.get<mapnik::value_integer>("pipeline_threads", 0)),
+      pipeline_queue_size_(*params.get<mapnik::value_integer>("pipeline_queue_size", 256)),
+      read_ahead_rows_(*params.get<mapnik::value_integer>("read_ahead_rows", 0)),
+      read_ahead_bytes_(*params.get<mapnik::value_integer>("read_ahead_bytes", 16 * 1024 * 1024)),
+      fetch_block_size_(*params.get<mapnik::value_integer>("fetch_block_size", 0)),
+      intern_strings_(*params.get<mapnik::boolean_type>("intern_strings", false)),
+      parameterized_queries_(*params.get<mapnik::boolean_type>("parameterized_queries", false))
 
 {
 #ifdef MAPNIK_STATS
@@ -130,6 +147,11 @@ mssql_datasource::mssql_datasource(parameters const& params)
             throw mapnik::datasource_exception(err.str());
         }
         asynchronous_request_ = true;
+
+        // runs the asynchronous executions, the driver async mode is not
+        // available with unixODBC
+        mapnik::value_integer io_threads = *params.get<mapnik::value_integer>("async_io_threads", max_async_connections_);
+        io_pool_ = std::make_shared<io_thread_pool>(unsigned(std::max<mapnik::value_integer>(io_threads, 1)));
     }
     auto pp = odbc_instance_.use_count();
     boost::optional<mapnik::value_integer> initial_size = params.get<mapnik::value_integer>("initial_size", 1);
@@ -139,10 +161,83 @@ mssql_datasource::mssql_datasource(parameters const& params)
     boost::optional<mapnik::boolean_type> simplify_opt = params.get<mapnik::boolean_type>("simplify_geometries", false);
     simplify_geometries_ = simplify_opt && *simplify_opt;
 
-    ConnectionManager::instance().registerPool(creator_, *initial_size, pool_max_size_);
+    // reduce runs on the server, the other algorithms while decoding
+    std::string simplify_algorithm = *params.get<std::string>("simplify_algorithm", "reduce");
+    if (simplify_algorithm == "snap")
+    {
+        simplify_algorithm_ = geometry_simplify::SNAP;
+    }
+    else if (simplify_algorithm == "douglas-peucker")
+    {
+        simplify_algorithm_ = geometry_simplify::DOUGLAS_PEUCKER;
+    }
+    else if (simplify_algorithm == "visvalingam")
+    {
+        simplify_algorithm_ = geometry_simplify::VISVALINGAM;
+    }
+    else if (simplify_algorithm != "reduce")
+    {
+        throw mapnik::datasource_exception("Mssql Plugin: unknown simplify_algorithm '" + simplify_algorithm +
+                                           "', expected reduce, snap, douglas-peucker or visvalingam");
+    }
+
+    geometry_options_.trust_orientation = *params.get<mapnik::boolean_type>("trust_orientation", false);
+
+    // the waits of the threads which find every connection in use are
+    // bounded, the others fail at once
+    mapnik::value_integer borrow_timeout = *params.get<mapnik::value_integer>("borrow_timeout", 1000);
+    mapnik::value_integer max_borrow_waiters = *params.get<mapnik::value_integer>("max_borrow_waiters", 64);
+    // dead sessions are found and replaced before a query is run on them
+    pool_health_options health;
+    health.check_interval = std::chrono::seconds(*params.get<mapnik::value_integer>("health_check_interval", 30));
+    health.ping_interval = std::chrono::seconds(*params.get<mapnik::value_integer>("ping_interval", 60));
+    health.idle_timeout = std::chrono::seconds(*params.get<mapnik::value_integer>("idle_timeout", 0));
+    health.max_lifetime = std::chrono::seconds(*params.get<mapnik::value_integer>("max_lifetime", 0));
+
+    // the initial_size connections are opened concurrently, so the first
+    // queries do not wait for logins one after the other
+    std::string warm_up = *params.get<std::string>("warm_up", "sync");
+    pool_warm_up warm_up_mode = WARM_UP_SYNC;
+    if (warm_up == "background")
+    {
+        warm_up_mode = WARM_UP_BACKGROUND;
+    }
+    else if (warm_up == "lazy")
+    {
+        warm_up_mode = WARM_UP_LAZY;
+    }
+    else if (warm_up != "sync")
+    {
+        throw mapnik::datasource_exception("Mssql Plugin: unknown warm_up '" + warm_up +
+                                           "', expected sync, background or lazy");
+    }
+
+    // a forked render worker opens its own connections before its first
+    // queries need them
+    bool warm_up_after_fork = *params.get<mapnik::boolean_type>("warm_up_after_fork", true);
+
+    // caps the sessions of every pool of the process, or of the pools to
+    // the same server, whatever their max_size
+    mapnik::value_integer connection_budget = *params.get<mapnik::value_integer>("connection_budget", 0);
+    bool connection_budget_per_host = *params.get<mapnik::boolean_type>("connection_budget_per_host", false);
+
+    ConnectionManager::instance().registerPool(creator_, *initial_size, pool_max_size_,
+                                               std::chrono::milliseconds(std::max<mapnik::value_integer>(borrow_timeout, 0)),
+                                               unsigned(std::max<mapnik::value_integer>(max_borrow_waiters, 0)),
+                                               health, warm_up_mode,
+                                               warm_up_after_fork ? WARM_UP_BACKGROUND : WARM_UP_LAZY,
+                                               unsigned(std::max<mapnik::value_integer>(connection_budget, 0)),
+                                               connection_budget_per_host);
     CnxPool_ptr pool = ConnectionManager::instance().getPool(creator_.id());
     if (pool)
     {
+        // known here with warm_up=sync, the background one may still be running
+        std::chrono::milliseconds warm_up_time = pool->warm_up_time();
+        if (warm_up_time.count() >= 0)
+        {
+            desc_.get_extra_parameters()["warm_up_ms"] = mapnik::value_integer(warm_up_time.count());
+        }
+
         shared_ptr<Connection> conn = pool->borrowObject();
         if (!conn)
         {
@@ -249,6 +344,11 @@ mssql_datasource::mssql_datasource(parameters const& params)
                 }
             }
 
+            if (!geometryColumn_.empty())
+            {
+                find_spatial_index(conn, *params.get<std::string>("spatial_index_hint", ""));
+            }
+
             // detect primary key
             if (*autodetect_key_field && key_field_.empty())
             {
@@ -397,8 +497,8 @@ mssql_datasource::mssql_datasource(parameters const& params)
             rs->close();
         }
 
-        // Close explicitly the connection so we can 'fork()' without sharing open connections
-        conn->close();
+        // the connection stays open: a forked process replaces the pools it
+        // inherits, see ConnectionManager::getPool
 
         // Finally, add unique metadata to layer descriptor
         mapnik::parameters& extra_params = desc_.get_extra_parameters();
@@ -420,7 +520,7 @@ mssql_datasource::~mssql_datasource()
         {
             try
             {
-                shared_ptr<Connection> conn = pool->borrowObject();
+                shared_ptr<Connection> conn = pool->tryBorrowObject();
                 if (conn)
                 {
                     conn->close();
@@ -455,29 +555,130 @@ layer_descriptor mssql_datasource::get_descriptor() const
     return desc_;
 }
 
-std::string mssql_datasource::sql_bbox(box2d<double> const& env) const
+void mssql_datasource::find_spatial_index(shared_ptr<Connection> const& conn, std::string const& index_hint)
+{
+#ifdef MAPNIK_STATS
+    mapnik::progress_timer __stats__(std::clog, "mssql_datasource::init(find_spatial_index)");
+#endif
+    std::string object_name = geometry_table_;
+    if (!schema_.empty())
+    {
+        object_name = schema_ + "." + object_name;
+    }
+
+    std::ostringstream s;
+    s << "SELECT si.name, sit.tessellation_scheme, sit.bounding_box_xmin, sit.bounding_box_ymin, "
+         "sit.bounding_box_xmax, sit.bounding_box_ymax "
+         "FROM sys.spatial_indexes si "
+         "JOIN sys.index_columns ic ON ic.object_id = si.object_id AND ic.index_id = si.index_id "
+         "JOIN sys.columns c ON c.object_id = ic.object_id AND c.column_id = ic.column_id "
+         "LEFT JOIN sys.spatial_index_tessellations sit ON sit.object_id = si.object_id AND sit.index_id = si.index_id "
+         "WHERE si.is_disabled = 0 AND si.object_id = OBJECT_ID('"
+      << boost::algorithm::replace_all_copy(object_name, "'", "''")
+      << "') AND c.name = '"
+      << boost::algorithm::replace_all_copy(mapnik::sql_utils::unquote_double(geometryColumn_), "'", "''")
+      << "' ORDER BY si.index_id";
+
+    try
+    {
+        shared_ptr<ResultSet> rs = conn->executeQuery(s.str());
+        while (rs->next())
+        {
+            std::string name = rs->getString(0);
+            std::string scheme = rs->getString(1);
+            boost::optional<double> xmin = rs->getDouble(2);
+            boost::optional<double> ymin = rs->getDouble(3);
+            boost::optional<double> xmax = rs->getDouble(4);
+            boost::optional<double> ymax = rs->getDouble(5);
+
+            MAPNIK_LOG_DEBUG(mssql) << "mssql_datasource: spatial index " << name << " (" << scheme << ") on "
+                                    << object_name << "." << geometryColumn_;
+            if (xmin && ymin && xmax && ymax)
+            {
+                MAPNIK_LOG_DEBUG(mssql) << "mssql_datasource: spatial index " << name << " bounding box "
+                                        << *xmin << "," << *ymin << "," << *xmax << "," << *ymax;
+            }
+            if (spatial_index_.empty())
+            {
+                spatial_index_ = name;
+            }
+        }
+        rs->close();
+    }
+    catch (mapnik::datasource_exception const& ex)
+    {
+        // the catalog views need VIEW DEFINITION, this is not fatal
+        MAPNIK_LOG_WARN(mssql) << "mssql_datasource: spatial index lookup failed: " << ex.what();
+        return;
+    }
+
+    if (spatial_index_.empty())
+    {
+        MAPNIK_LOG_WARN(mssql) << "mssql_datasource: no spatial index on " << object_name << "." << geometryColumn_
+                               << ", bbox queries will scan the table";
+    }
+    else
+    {
+        desc_.get_extra_parameters()["spatial_index"] = spatial_index_;
+    }
+
+    if (index_hint.empty())
+    {
+        return;
+    }
+    std::string index = index_hint == "auto" ? spatial_index_ : index_hint;
+    if (index.empty())
+    {
+        MAPNIK_LOG_WARN(mssql) << "mssql_datasource: spatial_index_hint ignored, no spatial index found";
+    }
+    else if (table_.find_first_of("( \t\r\n") != std::string::npos)
+    {
+        // the hint must follow a table name, not a subquery
+        MAPNIK_LOG_WARN(mssql) << "mssql_datasource: spatial_index_hint ignored, table is not a table name";
+    }
+    else
+    {
+        table_hint_ = " WITH (INDEX([" + mapnik::sql_utils::unquote_double(index) + "]))";
+    }
+}
+
+std::string mssql_datasource::bbox_wkt(box2d<double> const& env) const
 {
     std::ostringstream b;
 
     if(env.minx() == env.maxx() && env.minx() == env.miny()){
-        b << geometryColumnType_ << "::STGeomFromText('POINT(";
+        b << "POINT(";
         b << std::setprecision(16);
         b << env.minx() << " " << env.miny();       
-        b << ")', " << srid_ << ")";
+        b << ")";
     }else{
-        b << geometryColumnType_ << "::STGeomFromText('POLYGON((";
+        b << "POLYGON((";
         b << std::setprecision(16);
         b << env.minx() << " " << env.miny() << ",";
         b << env.maxx() << " " << env.miny() << ",";
         b << env.maxx() << " " << env.maxy() << ",";
         b << env.minx() << " " << env.maxy() << ",";
-        b << env.minx() << " " << env.miny() << "))', " << srid_ << ")";
+        b << env.minx() << " " << env.miny() << "))";
     }
    
 
     return b.str();
 }
 
+std::string mssql_datasource::sql_bbox(box2d<double> const& env) const
+{
+    std::ostringstream b;
+    b << geometryColumnType_ << "::STGeomFromText('" << bbox_wkt(env) << "', " << srid_ << ")";
+    return b.str();
+}
+
+std::string mssql_datasource::sql_bbox_parameter() const
+{
+    std::ostringstream b;
+    b << geometryColumnType_ << "::STGeomFromText(?, " << srid_ << ")";
+    return b.str();
+}
+
 std::string mssql_datasource::populate_tokens(std::string const& sql) const
 {
     std::string populated_sql = sql;
@@ -486,24 +687,24 @@ std::string mssql_datasource::populate_tokens(std::string const& sql) const
     {
         box2d<double> max_env(-1.0 * FMAX, -1.0 * FMAX, FMAX, FMAX);
         const std::string max_box = sql_bbox(max_env);
-        boost::algorithm::replace_all(populated_sql, bbox_token_, max_box);
+        boost::algorithm::ireplace_all(populated_sql, bbox_token_, max_box);
     }
 
     if (boost::algorithm::icontains(sql, scale_denom_token_))
     {
         std::ostringstream ss;
         ss << FMAX;
-        boost::algorithm::replace_all(populated_sql, scale_denom_token_, ss.str());
+        boost::algorithm::ireplace_all(populated_sql, scale_denom_token_, ss.str());
     }
 
     if (boost::algorithm::icontains(sql, pixel_width_token_))
     {
-        boost::algorithm::replace_all(populated_sql, pixel_width_token_, "0");
+        boost::algorithm::ireplace_all(populated_sql, pixel_width_token_, "0");
     }
 
     if (boost::algorithm::icontains(sql, pixel_height_token_))
     {
-        boost::algorithm::replace_all(populated_sql, pixel_height_token_, "0");
+        boost::algorithm::ireplace_all(populated_sql, pixel_height_token_, "0");
     }
 
     return populated_sql;
@@ -515,35 +716,42 @@ std::string mssql_datasource::populate_tokens(
     box2d<double> const& env,
     double pixel_width,
     double pixel_height,
-    mapnik::attributes const& vars) const
+    mapnik::attributes const& vars,
+    sql_parameters* params) const
 {
     std::string populated_sql = sql;
-    std::string box = sql_bbox(env);
+    std::string box = params ? sql_bbox_parameter() : sql_bbox(env);
+
+    if (params)
+    {
+        // no token is left for the replacements below
+        populated_sql = bind_tokens(sql, scale_denom, env, pixel_width, pixel_height, *params);
+    }
 
     if (boost::algorithm::icontains(populated_sql, scale_denom_token_))
     {
         std::ostringstream ss;
         ss << scale_denom;
-        boost::algorithm::replace_all(populated_sql, scale_denom_token_, ss.str());
+        boost::algorithm::ireplace_all(populated_sql, scale_denom_token_, ss.str());
     }
 
     if (boost::algorithm::icontains(sql, pixel_width_token_))
     {
         std::ostringstream ss;
         ss << pixel_width;
-        boost::algorithm::replace_all(populated_sql, pixel_width_token_, ss.str());
+        boost::algorithm::ireplace_all(populated_sql, pixel_width_token_, ss.str());
     }
 
     if (boost::algorithm::icontains(sql, pixel_height_token_))
     {
         std::ostringstream ss;
         ss << pixel_height;
-        boost::algorithm::replace_all(populated_sql, pixel_height_token_, ss.str());
+        boost::algorithm::ireplace_all(populated_sql, pixel_height_token_, ss.str());
     }
 
-    if (boost::algorithm::icontains(populated_sql, bbox_token_))
+    if (boost::algorithm::icontains(sql, bbox_token_))
     {
-        boost::algorithm::replace_all(populated_sql, bbox_token_, box);
+        boost::algorithm::ireplace_all(populated_sql, bbox_token_, box);
         return populated_sql;
     }
     else
@@ -558,7 +766,7 @@ std::string mssql_datasource::populate_tokens(
             {
                 s << "[" << geometryColumn_ << "].STIsValid() = 1 AND ";
             }
-            if (use_filter_)
+            if (use_filter_ || hybrid_filter_)
             {
                 s << "[" << geometryColumn_ << "].Filter(" << box << ") = 1";
             }
@@ -566,6 +774,13 @@ std::string mssql_datasource::populate_tokens(
             {
                 s << "[" << geometryColumn_ << "].STIntersects(" << box << ") = 1";
             }
+            if (params)
+            {
+                params->add(bbox_wkt(env));
+            }
+
+            // the spatial index can only be forced with a spatial predicate
+            populated_sql += table_hint_;
         }
         else
         {
@@ -576,13 +791,73 @@ std::string mssql_datasource::populate_tokens(
     }
 }
 
-shared_ptr<IResultSet> mssql_datasource::get_resultset(shared_ptr<Connection>& conn, std::string const& sql, CnxPool_ptr const& pool, processor_context_ptr ctx) const
+std::string mssql_datasource::bind_tokens(
+    std::string const& sql,
+    double scale_denom,
+    box2d<double> const& env,
+    double pixel_width,
+    double pixel_height,
+    sql_parameters& params) const
+{
+    // a token may appear several times, the values are added in the order
+    // of the markers. Tokens are matched whatever their case, as
+    // populate_tokens does.
+    std::string const lower_sql = boost::algorithm::to_lower_copy(sql);
+    std::string const tokens[] = {boost::algorithm::to_lower_copy(bbox_token_), boost::algorithm::to_lower_copy(scale_denom_token_),
+                                  boost::algorithm::to_lower_copy(pixel_width_token_), boost::algorithm::to_lower_copy(pixel_height_token_)};
+    std::string bound_sql;
+    std::size_t pos = 0;
+    for (;;)
+    {
+        std::size_t found = std::string::npos;
+        std::size_t token = 0;
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            std::size_t p = lower_sql.find(tokens[i], pos);
+            if (p < found)
+            {
+                found = p;
+                token = i;
+            }
+        }
+        if (found == std::string::npos)
+        {
+            break;
+        }
+
+        bound_sql.append(sql, pos, found - pos);
+        switch (token)
+        {
+        case 0:
+            bound_sql += sql_bbox_parameter();
+            params.add(bbox_wkt(env));
+            break;
+        case 1:
+            bound_sql += "?";
+            params.add(scale_denom);
+            break;
+        case 2:
+            bound_sql += "?";
+            params.add(pixel_width);
+            break;
+        default:
+            bound_sql += "?";
+            params.add(pixel_height);
+            break;
+        }
+        pos = found + tokens[token].size();
+    }
+    bound_sql.append(sql, pos, std::string::npos);
+    return bound_sql;
+}
+
+shared_ptr<IResultSet> mssql_datasource::get_resultset(shared_ptr<Connection>& conn, std::string const& sql, sql_parameters const& params, CnxPool_ptr const& pool, processor_context_ptr ctx) const
 {
 
     if (!ctx)
     {
 
-        return std::make_shared<CursorResultSet>(pool, conn, sql);
+        return std::make_shared<CursorResultSet>(pool, conn, sql, params, fetch_block_size_ > 0 ? fetch_block_size_ : 0);
     }
     else
     {
@@ -592,13 +867,13 @@ shared_ptr<IResultSet> mssql_datasource::get_resultset(shared_ptr<Connection>& c
         if (conn)
         {
             // lauch async req & create asyncresult with conn
-            conn->executeAsyncQuery(sql);
-            return std::make_shared<AsyncResultSet>(pgis_ctxt, pool, conn, sql);
+            conn->executeAsyncQuery(sql, params, io_pool_.get());
+            return std::make_shared<AsyncResultSet>(pgis_ctxt, pool, conn, sql, params, fetch_block_size_ > 0 ? fetch_block_size_ : 0, io_pool_);
         }
         else
         {
             // create asyncresult  with  null connection
-            shared_ptr<AsyncResultSet> res = std::make_shared<AsyncResultSet>(pgis_ctxt, pool, conn, sql);
+            shared_ptr<AsyncResultSet> res = std::make_shared<AsyncResultSet>(pgis_ctxt, pool, conn, sql, params, fetch_block_size_ > 0 ? fetch_block_size_ : 0, io_pool_);
             pgis_ctxt->add_request(res);
             return res;
         }
@@ -659,7 +934,9 @@ featureset_ptr mssql_datasource::features_with_context(query const& q, processor
             shared_ptr<mssql_processor_context> pgis_ctxt = std::static_pointer_cast<mssql_processor_context>(proc_ctx);
             if (pgis_ctxt->num_async_requests_ < max_async_connections_)
             {
-                conn = pool->borrowObject();
+                // without a free connection the query is run later, when
+                // one of the previous ones is done
+                conn = pool->tryBorrowObject();
                 pgis_ctxt->num_async_requests_++;
             }
         }
@@ -696,26 +973,85 @@ featureset_ptr mssql_datasource::features_with_context(query const& q, processor
         }
 
         std::ostringstream s;
+        // bound values keep the statement text, and so its plan, the same
+        // from one query to the next
+        sql_parameters sql_params;
+        sql_parameters* bound_params = parameterized_queries_ ? &sql_params : nullptr;
 
         const double px_gw = 1.0 / std::get<0>(q.resolution());
         const double px_gh = 1.0 / std::get<1>(q.resolution());
 
+        mapnik::context_ptr ctx = std::make_shared<mapnik::context_type>();
+        if (!key_field_.empty() && key_field_as_attribute_)
+        {
+            ctx->push(key_field_);
+        }
+
+        // with fetch_block_size the numeric attributes come before the
+        // geometry: BlockResultSet binds them, and the columns read with
+        // SQLGetData all follow the bound ones as SQL Server's drivers require
+        auto const& desc = desc_.get_descriptors();
+        auto is_numeric = [&desc](std::string const& name) {
+            for (auto const& attr_info : desc)
+            {
+                if (attr_info.get_name() == name)
+                {
+                    return attr_info.get_type() == mapnik::Integer || attr_info.get_type() == mapnik::Double;
+                }
+            }
+            return false;
+        };
+        std::ostringstream leading;
+        std::vector<std::string> trailing;
+        int geometry_column = 0;
+        for (std::string const& name : q.property_names())
+        {
+            if (name == key_field_)
+            {
+                continue;
+            }
+            ctx->push(name);
+            if (fetch_block_size_ > 1 && is_numeric(name))
+            {
+                mapnik::sql_utils::quote_attr(leading, name);
+                ++geometry_column;
+            }
+            else
+            {
+                trailing.push_back(name);
+            }
+        }
+
         s << "SELECT ";
         if (row_limit_ > 0)
         {
             s << " TOP " << row_limit_;
         }
 
+        if (geometry_column > 0)
+        {
+            // quote_attr writes a comma before each column
+            s << " " << leading.str().substr(1) << ",";
+        }
+
         s << "[" << geometryColumn_ << "]";
 
-        if (simplify_geometries_)
+        if (simplify_geometries_ && simplify_algorithm_ == geometry_simplify::NONE)
         {
             s << ".Reduce(";
             // 1/20 of pixel seems to be a good compromise to avoid
             // drop of collapsed polygons.
             // See https://github.com/mapnik/mapnik/issues/1639
             const double tolerance = std::min(px_gw, px_gh) / 20.0;
-            s << tolerance << ")";
+            if (bound_params)
+            {
+                s << "?)";
+                bound_params->add(tolerance);
+            }
+            else
+            {
+                s << tolerance << ")";
+            }
         }
 
         if (wkb_)
@@ -725,38 +1061,16 @@ featureset_ptr mssql_datasource::features_with_context(query const& q, processor
 
         s << " AS geom";
 
-        mapnik::context_ptr ctx = std::make_shared<mapnik::context_type>();
-        std::set<std::string> const& props = q.property_names();
-        std::set<std::string>::const_iterator pos = props.begin();
-        std::set<std::string>::const_iterator end = props.end();
-
         if (!key_field_.empty())
         {
             mapnik::sql_utils::quote_attr(s, key_field_);
-            if (key_field_as_attribute_)
-            {
-                ctx->push(key_field_);
-            }
-
-            for (; pos != end; ++pos)
-            {
-                if (*pos != key_field_)
-                {
-                    mapnik::sql_utils::quote_attr(s, *pos);
-                    ctx->push(*pos);
-                }
-            }
         }
-        else
+        for (std::string const& name : trailing)
         {
-            for (; pos != end; ++pos)
-            {
-                mapnik::sql_utils::quote_attr(s, *pos);
-                ctx->push(*pos);
-            }
+            mapnik::sql_utils::quote_attr(s, name);
         }
 
-        std::string table_with_bbox = populate_tokens(table_, scale_denom, box, px_gw, px_gh, q.variables());
+        std::string table_with_bbox = populate_tokens(table_, scale_denom, box, px_gw, px_gh, q.variables(), bound_params);
 
         s << " FROM " << table_with_bbox;
 
@@ -770,8 +1084,45 @@ featureset_ptr mssql_datasource::features_with_context(query const& q, processor
             s << " OPTION(QUERYTRACEON 4199)";
         }
 
-        shared_ptr<IResultSet> rs = get_resultset(conn, s.str(), pool, proc_ctx);
-        return std::make_shared<mssql_featureset>(rs, ctx, wkb_, geometryColumnType_ == "geography", !key_field_.empty(), key_field_as_attribute_);
+        // curves are linearized on the client, arc_tolerance is in pixels
+        geometry_decode_options geometry_options(geometry_options_);
+        geometry_options.arc_tolerance = arc_tolerance_ * std::min(px_gw, px_gh);
+
+        // client side simplification, simplify_tolerance is in pixels
+        if (simplify_geometries_ && simplify_algorithm_ != geometry_simplify::NONE)
+        {
+            geometry_options.simplify = simplify_algorithm_;
+            geometry_options.simplify_tolerance = simplify_tolerance_ * std::min(px_gw, px_gh);
+        }
+
+        // Filter() may return false positives, drop them while decoding
+        if (hybrid_filter_)
+        {
+            geometry_options.filter = true;
+            geometry_options.filter_box = box;
+        }
+
+        // clip to the query box, clip_buffer is in pixels
+        if (clip_geometries_)
+        {
+            geometry_options.clip = true;
+            geometry_options.clip_box = box;
+            geometry_options.clip_box.pad(clip_buffer_ * std::max(px_gw, px_gh));
+        }
+
+        shared_ptr<IResultSet> rs = get_resultset(conn, s.str(), sql_params, pool, proc_ctx);
+        if (pipeline_threads_ > 0)
+        {
+            // decode rows on worker threads while the next ones are fetched
+            return std::make_shared<mssql_pipelined_featureset>(rs, ctx, wkb_, geometryColumnType_ == "geography", !key_field_.empty(), key_field_as_attribute_, intern_strings_, geometry_options,
+                                                                geometry_column, pipeline_threads_, pipeline_queue_size_ > 0 ? pipeline_queue_size_ : 1);
+        }
+        if (read_ahead_rows_ > 0)
+        {
+            // fetch rows in the background while the renderer works
+            rs = std::make_shared<ReadAheadResultSet>(rs, read_ahead_rows_, read_ahead_bytes_ > 0 ? read_ahead_bytes_ : 0, geometry_column);
+        }
+        return std::make_shared<mssql_featureset>(rs, ctx, wkb_, geometryColumnType_ == "geography", !key_field_.empty(), key_field_as_attribute_, intern_strings_, geometry_options, geometry_column);
     }
 
     return mapnik::make_invalid_featureset();
@@ -860,7 +1211,8 @@ featureset_ptr mssql_datasource::features_at_point(coord2d const& pt, double tol
             }
 
             box2d<double> box(pt.x - tol, pt.y - tol, pt.x + tol, pt.y + tol);
-            std::string table_with_bbox = populate_tokens(table_, FMAX, box, 0, 0, mapnik::attributes());
+            sql_parameters sql_params;
+            std::string table_with_bbox = populate_tokens(table_, FMAX, box, 0, 0, mapnik::attributes(), parameterized_queries_ ? &sql_params : nullptr);
 
             s << " FROM " << table_with_bbox;
 
@@ -868,8 +1220,15 @@ featureset_ptr mssql_datasource::features_at_point(coord2d const& pt, double tol
             {
                 s << " OPTION(QUERYTRACEON 4199)";
             }
-            shared_ptr<IResultSet> rs = get_resultset(conn, s.str(), pool);
-            return std::make_shared<mssql_featureset>(rs, ctx, wkb_, geometryColumnType_ == "geography", !key_field_.empty(), key_field_as_attribute_);
+            geometry_decode_options geometry_options(geometry_options_);
+            if (hybrid_filter_)
+            {
+                geometry_options.filter = true;
+                geometry_options.filter_box = box;
+            }
+
+            shared_ptr<IResultSet> rs = get_resultset(conn, s.str(), sql_params, pool);
+            return std::make_shared<mssql_featureset>(rs, ctx, wkb_, geometryColumnType_ == "geography", !key_field_.empty(), key_field_as_attribute_, intern_strings_, geometry_options, 0);
         }
     }
 
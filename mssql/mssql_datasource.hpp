@@ -44,6 +44,7 @@
 #include <vector>
 
 #include "connection_manager.hpp"
+#include "geoclr_reader.hpp"
 //#include "cursorresultset.hpp"
 //#include "resultset.hpp"
 
@@ -77,15 +78,27 @@ class mssql_datasource : public datasource
     layer_descriptor get_descriptor() const;
 
   private:
+    std::string bbox_wkt(box2d<double> const& env) const;
     std::string sql_bbox(box2d<double> const& env) const;
+    std::string sql_bbox_parameter() const;
+    // with params, the tokens and the bbox become ? markers and their values
+    // are added to params
     std::string populate_tokens(std::string const& sql,
                                 double scale_denom,
                                 box2d<double> const& env,
                                 double pixel_width,
                                 double pixel_height,
-                                mapnik::attributes const& vars) const;
+                                mapnik::attributes const& vars,
+                                sql_parameters* params = nullptr) const;
     std::string populate_tokens(std::string const& sql) const;
-    std::shared_ptr<IResultSet> get_resultset(std::shared_ptr<Connection>& conn, std::string const& sql, CnxPool_ptr const& pool, processor_context_ptr ctx = processor_context_ptr()) const;
+    void find_spatial_index(std::shared_ptr<Connection> const& conn, std::string const& index_hint);
+    std::string bind_tokens(std::string const& sql,
+                            double scale_denom,
+                            box2d<double> const& env,
+                            double pixel_width,
+                            double pixel_height,
+                            sql_parameters& params) const;
+    std::shared_ptr<IResultSet> get_resultset(std::shared_ptr<Connection>& conn, std::string const& sql, sql_parameters const& params, CnxPool_ptr const& pool, processor_context_ptr ctx = processor_context_ptr()) const;
     static const double FMAX;
 
     const std::string uri_;
@@ -98,16 +111,21 @@ class mssql_datasource : public datasource
     std::string key_field_;
     bool wkb_;
     bool use_filter_;
+    bool hybrid_filter_;
     bool trace_flag_4199_;
 
     mapnik::value_integer row_limit_;
     std::string geometryColumn_;
     std::string geometryColumnType_;
+    std::string spatial_index_;
+    std::string table_hint_;
     mapnik::datasource::datasource_t type_;
     int srid_;
     mutable bool extent_initialized_;
     mutable mapnik::box2d<double> extent_;
     bool simplify_geometries_;
+    geometry_simplify::algorithm simplify_algorithm_;
+    double simplify_tolerance_;
     layer_descriptor desc_;
     std::shared_ptr<Odbc> odbc_instance_;
     ConnectionCreator<Connection> creator_;
@@ -121,10 +139,22 @@ class mssql_datasource : public datasource
     bool estimate_extent_;
     int max_async_connections_;
     bool asynchronous_request_;
+    std::shared_ptr<io_thread_pool> io_pool_;
     int intersect_min_scale_;
     int intersect_max_scale_;
     bool key_field_as_attribute_;
     std::string order_by_;
+    double arc_tolerance_;
+    bool clip_geometries_;
+    double clip_buffer_;
+    int pipeline_threads_;
+    int pipeline_queue_size_;
+    int read_ahead_rows_;
+    int read_ahead_bytes_;
+    int fetch_block_size_;
+    bool intern_strings_;
+    bool parameterized_queries_;
+    geometry_decode_options geometry_options_;
 };
 
 #endif // MSSQL_DATASOURCE_HPP
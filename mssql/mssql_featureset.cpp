@@ -21,12 +21,15 @@
  *****************************************************************************/
 
 #include "geoclr_reader.hpp"
+#include "geometry_clip.hpp"
+#include "geometry_simplify.hpp"
 #include "mssql_featureset.hpp"
 #include "resultset.hpp"
 
 // mapnik
 #include <mapnik/debug.hpp>
 #include <mapnik/feature_factory.hpp>
+#include <mapnik/geometry_envelope.hpp>
 ///#include <mapnik/global.hpp> // for int2net
 #include <mapnik/unicode.hpp>
 ///#include <mapnik/util/conversions.hpp>
@@ -44,155 +47,278 @@ using mapnik::geometry_utils;
 using mapnik::feature_factory;
 using mapnik::context_ptr;
 
-mssql_featureset::mssql_featureset(std::shared_ptr<IResultSet> const& rs,
-                                   context_ptr const& ctx,
-                                   bool wkb,
-                                   bool is_sqlgeography,
-                                   bool key_field,
-                                   bool key_field_as_attribute)
-    : rs_(rs),
-      ctx_(ctx),
+// distinct values kept per string column when interning
+static const std::size_t max_interned_strings = 4096;
+
+mssql_feature_decoder::mssql_feature_decoder(context_ptr const& ctx,
+                                             bool wkb,
+                                             bool is_sqlgeography,
+                                             bool key_field,
+                                             bool key_field_as_attribute,
+                                             bool intern_strings,
+                                             geometry_decode_options const& geometry_options,
+                                             int geometry_column)
+    : ctx_(ctx),
       wkb_(wkb),
       is_sqlgeography_(is_sqlgeography),
-      tr_ucs2_(new transcoder("UTF-16LE")),
-      tr_(new transcoder("UTF-8")),
-      totalGeomSize_(0),
-      feature_id_(1),
       key_field_(key_field),
-      key_field_as_attribute_(key_field_as_attribute)
+      key_field_as_attribute_(key_field_as_attribute),
+      intern_strings_(intern_strings),
+      geometry_options_(geometry_options),
+      simplifier_(geometry_options.simplify, geometry_options.simplify_tolerance),
+      geometry_column_(geometry_column),
+      columns_resolved_(false)
 {
 }
 
-feature_ptr mssql_featureset::next()
+void mssql_feature_decoder::resolve_columns(IResultSet& rs)
 {
-    while (rs_->next())
+    int after_geometry = geometry_column_ + 1;
+    if (key_field_)
     {
-        // new feature
-        unsigned pos = 1;
-        feature_ptr feature;
+        key_name_ = rs.getFieldName(after_geometry);
+        ++after_geometry;
+    }
 
-        //get the geometry
-        std::vector<char> data = rs_->getBinary(0);
+    int num_attrs = int(ctx_->size()) + 1;
+    if (!key_field_as_attribute_)
+    {
+        num_attrs++;
+    }
 
-        if (key_field_)
+    columns_.clear();
+    for (int pos = 0; pos < num_attrs; ++pos)
+    {
+        if (pos >= geometry_column_ && pos < after_geometry)
+        {
+            continue;
+        }
+        attribute_column column;
+        column.index = pos;
+        column.name = rs.getFieldName(pos);
+
+        const int oid = rs.getTypeOID(pos);
+        switch (oid)
         {
-            std::string name = rs_->getFieldName(pos);
-
-            boost::optional<int> id = rs_->getInt(pos);
-            // null feature id is not acceptable
-            if (!id)
-            {
-                MAPNIK_LOG_WARN(mssql) << "mssql_featureset: null value encountered for key_field: " << name;
-                continue;
-            }
-
-            // validation happens of this type at initialization
-            mapnik::value_integer val;
-            val = id.get();
-
-            feature = feature_factory::create(ctx_, val);
-            if (key_field_as_attribute_)
-            {
-                feature->put<mapnik::value_integer>(name, val);
-            }
-            ++pos;
+        case SQL_BIT:
+            column.decode = &mssql_feature_decoder::put_bit;
+            break;
+        case SQL_SMALLINT:
+        case SQL_TINYINT:
+        case SQL_INTEGER:
+            column.decode = &mssql_feature_decoder::put_int;
+            break;
+        case SQL_BIGINT:
+            column.decode = &mssql_feature_decoder::put_bigint;
+            break;
+        case SQL_FLOAT:
+        case SQL_REAL:
+            column.decode = &mssql_feature_decoder::put_float;
+            break;
+        case SQL_DOUBLE:
+        case SQL_DECIMAL:
+        case SQL_NUMERIC:
+            column.decode = &mssql_feature_decoder::put_double;
+            break;
+        case SQL_CHAR:
+        case SQL_VARCHAR:
+        case SQL_LONGVARCHAR:
+            column.decode = &mssql_feature_decoder::put_string;
+            break;
+        case SQL_WCHAR:
+        case SQL_WVARCHAR:
+        case SQL_WLONGVARCHAR:
+            column.decode = &mssql_feature_decoder::put_wstring;
+            break;
+        default:
+            MAPNIK_LOG_WARN(mssql) << "mssql_featureset: Unknown type=" << oid;
+            continue;
         }
-        else
+        if (intern_strings_ && (column.decode == &mssql_feature_decoder::put_string ||
+                                column.decode == &mssql_feature_decoder::put_wstring))
         {
-            // fallback to auto-incrementing id
-            feature = feature_factory::create(ctx_, feature_id_);
-            ++feature_id_;
+            column.strings.reset(new intern_cache(max_interned_strings));
         }
+        columns_.push_back(std::move(column));
+    }
+    columns_resolved_ = true;
+}
+
+// NOTE: we intentionally do not store null here
+// since it is equivalent to the attribute not existing
+
+void mssql_feature_decoder::put_bit(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column)
+{
+    auto bit = rs.getInt(column.index);
+    if (bit)
+    {
+        feature.put(column.name, *bit != 0);
+    }
+}
+
+void mssql_feature_decoder::put_int(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column)
+{
+    putIfNotNull(feature, column.name, rs.getInt(column.index));
+}
 
-        // parse geometry
-        size_t size = data.size();
+void mssql_feature_decoder::put_bigint(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column)
+{
+    putIfNotNull(feature, column.name, rs.getBigInt(column.index));
+}
+
+void mssql_feature_decoder::put_float(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column)
+{
+    putIfNotNull(feature, column.name, rs.getFloat(column.index));
+}
 
-        // null geometry is not acceptable
-        if (size == 0)
+void mssql_feature_decoder::put_double(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column)
+{
+    putIfNotNull(feature, column.name, rs.getDouble(column.index));
+}
+
+void mssql_feature_decoder::put_string(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column)
+{
+    // opening an ICU converter is costly, keep one per thread
+    static thread_local transcoder tr("UTF-8");
+    const std::string text = rs.getString(column.index);
+    if (column.strings)
+    {
+        feature.put(column.name, column.strings->get(text.data(), text.size(), [&text]() {
+            return (UnicodeString)tr.transcode(text.c_str());
+        }));
+    }
+    else
+    {
+        feature.put(column.name, (UnicodeString)tr.transcode(text.c_str()));
+    }
+}
+
+void mssql_feature_decoder::put_wstring(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column)
+{
+    // UnicodeString is UTF-16 too, no conversion needed
+    binary_view text = rs.getUtf16View(column.index);
+    auto build = [&text]() {
+        return UnicodeString(reinterpret_cast<const UChar*>(text.data), int32_t(text.size / sizeof(UChar)));
+    };
+    if (column.strings)
+    {
+        feature.put(column.name, column.strings->get(text.data, text.size, build));
+    }
+    else
+    {
+        feature.put(column.name, build());
+    }
+}
+
+feature_ptr mssql_feature_decoder::decode(IResultSet& rs, mapnik::value_integer row_id)
+{
+    // new feature
+    feature_ptr feature;
+
+    //get the geometry
+    binary_view data = rs.getBinaryView(geometry_column_);
+
+    if (!columns_resolved_)
+    {
+        resolve_columns(rs);
+    }
+
+    boost::optional<int> id;
+    if (key_field_)
+    {
+        id = rs.getInt(geometry_column_ + 1);
+        // null feature id is not acceptable
+        if (!id)
         {
-            MAPNIK_LOG_WARN(mssql) << "mssql_featureset: null value encountered for geometry";
-            continue;
+            MAPNIK_LOG_WARN(mssql) << "mssql_featureset: null value encountered for key_field: " << key_name_;
+            return feature_ptr();
         }
+    }
+
+    // parse geometry
+    size_t size = data.size;
+
+    // null geometry is not acceptable
+    if (size == 0)
+    {
+        MAPNIK_LOG_WARN(mssql) << "mssql_featureset: null value encountered for geometry";
+        return feature_ptr();
+    }
 
-        mapnik::geometry::geometry<double> geometry;
-        if (wkb_)
+    mapnik::geometry::geometry<double> geometry;
+    if (wkb_)
+    {
+        geometry = geometry_utils::from_wkb(data.data, size);
+        if (geometry_options_.filter && !geometry_options_.filter_box.intersects(mapnik::geometry::envelope(geometry)))
+        {
+            return feature_ptr();
+        }
+        if (geometry_options_.clip)
         {
-            geometry = geometry_utils::from_wkb(&data[0], size);
+            geometry = geometry_clip::clip(std::move(geometry), geometry_options_.clip_box);
         }
-        else
+        simplifier_.apply(geometry);
+    }
+    else
+    {
+        geometry_simplify::simplifier* simplifier = simplifier_.get_algorithm() != geometry_simplify::NONE ? &simplifier_ : nullptr;
+        geometry = from_geoclr(data.data, size, is_sqlgeography_, geometry_options_, simplifier);
+        if (geometry_options_.filter && !geometry_options_.filter_box.intersects(mapnik::geometry::envelope(geometry)))
         {
-            geometry = from_geoclr(&data[0], size, is_sqlgeography_);
+            return feature_ptr();
         }
-        feature->set_geometry(std::move(geometry));
+    }
 
-        totalGeomSize_ += size;
+    if (key_field_)
+    {
+        // validation happens of this type at initialization
+        mapnik::value_integer val;
+        val = id.get();
 
-        unsigned num_attrs = ctx_->size() + 1;
-        if (!key_field_as_attribute_)
+        feature = feature_factory::create(ctx_, val);
+        if (key_field_as_attribute_)
         {
-            num_attrs++;
+            feature->put<mapnik::value_integer>(key_name_, val);
         }
+    }
+    else
+    {
+        // fallback to auto-incrementing id
+        feature = feature_factory::create(ctx_, row_id);
+    }
+    feature->set_geometry(std::move(geometry));
+
+    for (auto& column : columns_)
+    {
+        (this->*column.decode)(*feature, rs, column);
+    }
+    return feature;
+}
+
+mssql_featureset::mssql_featureset(std::shared_ptr<IResultSet> const& rs,
+                                   context_ptr const& ctx,
+                                   bool wkb,
+                                   bool is_sqlgeography,
+                                   bool key_field,
+                                   bool key_field_as_attribute,
+                                   bool intern_strings,
+                                   geometry_decode_options const& geometry_options,
+                                   int geometry_column)
+    : rs_(rs),
+      decoder_(ctx, wkb, is_sqlgeography, key_field, key_field_as_attribute, intern_strings, geometry_options, geometry_column),
+      feature_id_(1)
+{
+}
 
-        for (; pos < num_attrs; ++pos)
+feature_ptr mssql_featureset::next()
+{
+    while (rs_->next())
+    {
+        feature_ptr feature = decoder_.decode(*rs_, feature_id_++);
+        if (feature)
         {
-            std::string name = rs_->getFieldName(pos);
-
-            // NOTE: we intentionally do not store null here
-            // since it is equivalent to the attribute not existing
-
-            const int oid = rs_->getTypeOID(pos);
-
-            switch (oid)
-            {
-            case SQL_BIT:
-            {
-                auto bit = rs_->getInt(pos);
-                if (bit)
-                {
-                    feature->put(name, *bit != 0);
-                }
-                break;
-            }
-            case SQL_SMALLINT:
-            case SQL_TINYINT:
-            case SQL_INTEGER:
-                putIfNotNull(feature, name, rs_->getInt(pos));
-                break;
-            case SQL_BIGINT:
-                putIfNotNull(feature, name, rs_->getBigInt(pos));
-                break;
-            case SQL_FLOAT:
-            case SQL_REAL:
-                putIfNotNull(feature, name, (rs_->getFloat(pos)));
-                break;
-            case SQL_DOUBLE:
-                putIfNotNull(feature, name, rs_->getDouble(pos));
-                break;
-            case SQL_DECIMAL:
-            case SQL_NUMERIC:
-                putIfNotNull(feature, name, rs_->getDouble(pos));
-                break;
-            case SQL_CHAR:
-            case SQL_VARCHAR:
-            case SQL_LONGVARCHAR:
-                feature->put(name, (UnicodeString)tr_->transcode(rs_->getString(pos).c_str()));
-                break;
-            case SQL_WCHAR:
-            case SQL_WVARCHAR:
-            case SQL_WLONGVARCHAR:
-            {
-                auto stringbin = rs_->getBinary(pos);
-                feature->put(name, (UnicodeString)tr_ucs2_->transcode(stringbin.data(), stringbin.size()));
-                break;
-            }
-            default:
-            {
-                MAPNIK_LOG_WARN(mssql) << "mssql_featureset: Unknown type=" << oid;
-                break;
-            }
-            }
+            return feature;
         }
-        return feature;
     }
     return feature_ptr();
 }
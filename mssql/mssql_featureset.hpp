@@ -31,6 +31,11 @@
 #include <mapnik/featureset.hpp>
 #include <mapnik/unicode.hpp>
 #include <memory>
+#include <string>
+#include <vector>
+
+#include "geoclr_reader.hpp"
+#include "intern_cache.hpp"
 
 using mapnik::Featureset;
 using mapnik::box2d;
@@ -40,38 +45,93 @@ using mapnik::context_ptr;
 
 class IResultSet;
 
-class mssql_featureset : public mapnik::Featureset
+// Builds a feature from the current row of a result set. Not thread-safe,
+// the pipelined featureset uses one decoder per worker.
+class mssql_feature_decoder
 {
   public:
-    mssql_featureset(std::shared_ptr<IResultSet> const& rs,
-                     context_ptr const& ctx,
-                     bool wkb,
-                     bool is_sqlgeography,
-                     bool key_field,
-                     bool key_field_as_attribute);
-    feature_ptr next();
-    ~mssql_featureset();
+    mssql_feature_decoder(context_ptr const& ctx,
+                          bool wkb,
+                          bool is_sqlgeography,
+                          bool key_field,
+                          bool key_field_as_attribute,
+                          bool intern_strings,
+                          geometry_decode_options const& geometry_options,
+                          int geometry_column);
+
+    // row_id is the feature id when there is no key field, returns a null
+    // feature for rows that are skipped
+    feature_ptr decode(IResultSet& rs, mapnik::value_integer row_id);
 
   private:
-    std::shared_ptr<IResultSet> rs_;
+    struct attribute_column;
+    using attribute_decoder = void (mssql_feature_decoder::*)(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column);
+
+    struct attribute_column
+    {
+        int index;
+        std::string name;
+        attribute_decoder decode;
+        // values of a string column, null unless interning is on
+        std::unique_ptr<intern_cache> strings;
+    };
+
+    // reads the names and types of the columns from the first row, so the
+    // following rows need no metadata calls and no type dispatch
+    void resolve_columns(IResultSet& rs);
+
+    void put_bit(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column);
+    void put_int(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column);
+    void put_bigint(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column);
+    void put_float(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column);
+    void put_double(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column);
+    void put_string(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column);
+    void put_wstring(mapnik::feature_impl& feature, IResultSet& rs, attribute_column& column);
+
     context_ptr ctx_;
     bool wkb_;
     bool is_sqlgeography_;
-    const std::unique_ptr<mapnik::transcoder> tr_ucs2_;
-    const std::unique_ptr<mapnik::transcoder> tr_;
-    size_t totalGeomSize_;
-    mapnik::value_integer feature_id_;
     bool key_field_;
     bool key_field_as_attribute_;
+    bool intern_strings_;
+    geometry_decode_options geometry_options_;
+    geometry_simplify::simplifier simplifier_;
+    // the numeric attributes come first when rows are fetched in blocks, the
+    // key follows the geometry
+    int geometry_column_;
+    bool columns_resolved_;
+    std::string key_name_;
+    std::vector<attribute_column> columns_;
 
     template <typename T>
-    inline void putIfNotNull(feature_ptr feature, mapnik::context_type::key_type const& key, T const& val)
+    inline void putIfNotNull(mapnik::feature_impl& feature, mapnik::context_type::key_type const& key, T const& val)
     {
         if (val)
         {
-            feature->put(key, *val);
+            feature.put(key, *val);
         }
     }
 };
 
+class mssql_featureset : public mapnik::Featureset
+{
+  public:
+    mssql_featureset(std::shared_ptr<IResultSet> const& rs,
+                     context_ptr const& ctx,
+                     bool wkb,
+                     bool is_sqlgeography,
+                     bool key_field,
+                     bool key_field_as_attribute,
+                     bool intern_strings,
+                     geometry_decode_options const& geometry_options,
+                     int geometry_column);
+    feature_ptr next();
+    ~mssql_featureset();
+
+  private:
+    std::shared_ptr<IResultSet> rs_;
+    mssql_feature_decoder decoder_;
+    mapnik::value_integer feature_id_;
+};
+
 #endif // MSSQL_FEATURESET_HPP
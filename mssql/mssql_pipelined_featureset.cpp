@@ -0,0 +1,187 @@
+#include "mssql_pipelined_featureset.hpp"
+#include "resultset.hpp"
+
+// mapnik
+#include <mapnik/debug.hpp>
+
+// stl
+#include <algorithm>
+
+mssql_pipelined_featureset::mssql_pipelined_featureset(std::shared_ptr<IResultSet> const& rs,
+                                                       context_ptr const& ctx,
+                                                       bool wkb,
+                                                       bool is_sqlgeography,
+                                                       bool key_field,
+                                                       bool key_field_as_attribute,
+                                                       bool intern_strings,
+                                                       geometry_decode_options const& geometry_options,
+                                                       int geometry_column,
+                                                       unsigned threads,
+                                                       std::size_t queue_size)
+    : rs_(rs),
+      geometry_column_(geometry_column),
+      window_(queue_size > 0 ? queue_size : 1),
+      rows_(window_),
+      free_rows_(window_),
+      slots_(new result_slot[window_]),
+      stop_(false),
+      fetch_done_(false),
+      fetched_(0),
+      consumed_(0),
+      next_seq_(0)
+{
+    // simplification buffers and interned strings are per worker
+    for (unsigned i = 0; i < std::max(threads, 1u); ++i)
+    {
+        decoders_.emplace_back(new mssql_feature_decoder(ctx, wkb, is_sqlgeography, key_field, key_field_as_attribute, intern_strings, geometry_options, geometry_column));
+    }
+}
+
+// started on the first call to next(): an asynchronous result set must not
+// be read before its turn, its query may not even be sent yet
+void mssql_pipelined_featureset::start()
+{
+    threads_.emplace_back(&mssql_pipelined_featureset::fetch, this);
+    for (auto& decoder : decoders_)
+    {
+        threads_.emplace_back(&mssql_pipelined_featureset::decode, this, std::ref(*decoder));
+    }
+}
+
+mssql_pipelined_featureset::~mssql_pipelined_featureset()
+{
+    stop_.store(true, std::memory_order_release);
+    rows_ready_.notify_all();
+    space_.notify_all();
+    for (auto& thread : threads_)
+    {
+        thread.join();
+    }
+    rs_->close();
+}
+
+void mssql_pipelined_featureset::fetch()
+{
+    try
+    {
+        std::shared_ptr<const row_schema> schema;
+        uint64_t seq = 0;
+        while (!stop_.load(std::memory_order_acquire) && rs_->next())
+        {
+            if (!schema)
+            {
+                schema = std::make_shared<row_schema>(*rs_, geometry_column_);
+            }
+
+            // every row in flight owns a result slot until next() takes it
+            space_.await([this, seq]() {
+                return seq - consumed_.load(std::memory_order_acquire) < window_ || stop_.load(std::memory_order_acquire);
+            });
+            if (stop_.load(std::memory_order_acquire))
+            {
+                break;
+            }
+
+            row_task task;
+            task.seq = seq;
+            if (!free_rows_.try_pop(task.row))
+            {
+                task.row.reset(new RowSnapshot());
+            }
+            task.row->capture(*rs_, schema);
+
+            // cannot stay full, the queue is as large as the window
+            while (!rows_.try_push(std::move(task)))
+            {
+                std::this_thread::yield();
+            }
+            fetched_.store(++seq, std::memory_order_release);
+            rows_ready_.notify_one();
+        }
+    }
+    catch (...)
+    {
+        fetch_error_ = std::current_exception();
+    }
+    fetch_done_.store(true, std::memory_order_release);
+    rows_ready_.notify_all();
+    results_.notify_all();
+}
+
+void mssql_pipelined_featureset::decode(mssql_feature_decoder& decoder)
+{
+    row_task task;
+    for (;;)
+    {
+        bool popped = false;
+        rows_ready_.await([this, &task, &popped]() {
+            // read before popping: once the fetch is done, an empty queue
+            // means every row has been taken
+            bool done = fetch_done_.load(std::memory_order_acquire) || stop_.load(std::memory_order_acquire);
+            popped = rows_.try_pop(task);
+            return popped || done;
+        });
+        if (!popped)
+        {
+            return;
+        }
+
+        result_slot& slot = slots_[task.seq % window_];
+        try
+        {
+            slot.feature = decoder.decode(*task.row, mapnik::value_integer(task.seq + 1));
+        }
+        catch (...)
+        {
+            slot.error = std::current_exception();
+        }
+        slot.ready.store(true, std::memory_order_release);
+        results_.notify_one();
+        free_rows_.try_push(std::move(task.row));
+        task.row.reset();
+    }
+}
+
+feature_ptr mssql_pipelined_featureset::next()
+{
+    if (threads_.empty())
+    {
+        start();
+    }
+
+    for (;;)
+    {
+        result_slot& slot = slots_[next_seq_ % window_];
+        results_.await([this, &slot]() {
+            return slot.ready.load(std::memory_order_acquire) ||
+                   (fetch_done_.load(std::memory_order_acquire) && next_seq_ >= fetched_.load(std::memory_order_acquire));
+        });
+        if (slot.ready.load(std::memory_order_acquire))
+        {
+            feature_ptr feature = std::move(slot.feature);
+            slot.feature.reset();
+            std::exception_ptr error = slot.error;
+            slot.error = nullptr;
+            slot.ready.store(false, std::memory_order_relaxed);
+            consumed_.store(++next_seq_, std::memory_order_release);
+            space_.notify_one();
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+            if (feature)
+            {
+                return feature;
+            }
+            // skipped row
+            continue;
+        }
+        if (fetch_error_)
+        {
+            std::exception_ptr error = fetch_error_;
+            fetch_error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+        return feature_ptr();
+    }
+}
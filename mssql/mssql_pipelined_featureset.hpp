@@ -0,0 +1,83 @@
+#ifndef MSSQL_PIPELINED_FEATURESET_HPP
+#define MSSQL_PIPELINED_FEATURESET_HPP
+
+// mapnik
+#include <mapnik/feature.hpp>
+#include <mapnik/featureset.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "mpmc_queue.hpp"
+#include "mssql_featureset.hpp"
+#include "row_snapshot.hpp"
+
+// Featureset decoding rows on several threads: a fetch thread copies rows out
+// of the result set into a bounded queue, workers build the features and
+// next() hands them out in the order of the result set.
+class mssql_pipelined_featureset : public mapnik::Featureset
+{
+  public:
+    mssql_pipelined_featureset(std::shared_ptr<IResultSet> const& rs,
+                               context_ptr const& ctx,
+                               bool wkb,
+                               bool is_sqlgeography,
+                               bool key_field,
+                               bool key_field_as_attribute,
+                               bool intern_strings,
+                               geometry_decode_options const& geometry_options,
+                               int geometry_column,
+                               unsigned threads,
+                               std::size_t queue_size);
+    feature_ptr next();
+    ~mssql_pipelined_featureset();
+
+  private:
+    struct row_task
+    {
+        uint64_t seq;
+        std::unique_ptr<RowSnapshot> row;
+    };
+
+    // decoded row, slot seq % window_ holds row seq
+    struct result_slot
+    {
+        result_slot()
+            : ready(false) {}
+        std::atomic<bool> ready;
+        feature_ptr feature;
+        std::exception_ptr error;
+    };
+
+    void start();
+    void fetch();
+    void decode(mssql_feature_decoder& decoder);
+
+    std::shared_ptr<IResultSet> rs_;
+    const int geometry_column_;
+    std::vector<std::unique_ptr<mssql_feature_decoder>> decoders_;
+    const uint64_t window_; // max rows between the fetch thread and next()
+    mpmc_queue<row_task> rows_;
+    mpmc_queue<std::unique_ptr<RowSnapshot>> free_rows_;
+    const std::unique_ptr<result_slot[]> slots_;
+
+    event_count rows_ready_; // signalled by the fetch thread
+    event_count space_;      // signalled by next()
+    event_count results_;    // signalled by the decoders
+
+    std::atomic<bool> stop_;
+    std::atomic<bool> fetch_done_;
+    std::atomic<uint64_t> fetched_;
+    std::atomic<uint64_t> consumed_;
+    std::exception_ptr fetch_error_;
+    uint64_t next_seq_;
+
+    std::vector<std::thread> threads_;
+};
+
+#endif // MSSQL_PIPELINED_FEATURESET_HPP
@@ -1,245 +1,268 @@
 #include "mssqlclrgeo.hpp"
 #include <cstring>
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define MSSQLCLR_X86_64
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
 namespace mssqlclr {
 
+namespace {
 
-const std::vector<Figure> Geometry::getFiguresFromShape(int shapeIdx) const
-{
-    std::vector<Figure> figures_list;
-    if (Figures.empty())
-    {
-        return figures_list;
-    }
-    int32_t offset = Shapes[shapeIdx].FigureOffset;
+const std::size_t POINT_SIZE = 16;
+const std::size_t FIGURE_SIZE = 5;
+const std::size_t SHAPE_SIZE = 9;
+const uint32_t EMPTY_OFFSET = 0xFFFFFFFF;
 
-    if (Shapes.size() > shapeIdx + 1)
-    {
-        int32_t offsetEnd = Shapes[shapeIdx + 1].FigureOffset;
+template <typename T>
+inline T read_at(const char* data)
+{
+    T val;
+    std::memcpy(&val, data, sizeof(T));
+    return val;
+}
 
-        figures_list = std::vector<Figure>(Figures.cbegin() + offset, Figures.cbegin() + offsetEnd);
-    }
-    else
+void swap_points_scalar(double* dst, const char* src, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
     {
-        figures_list = std::vector<Figure>(Figures.cbegin() + offset, Figures.cend());
+        double pair[2];
+        std::memcpy(pair, src + i * POINT_SIZE, POINT_SIZE);
+        dst[2 * i] = pair[1];
+        dst[2 * i + 1] = pair[0];
     }
-    return figures_list;
 }
 
-const std::vector<Point> Geometry::getPointsFromFigure(int figureIdx) const
+#ifdef MSSQLCLR_X86_64
+
+// the points of a blob are not aligned, even for a double: they are loaded
+// as bytes, never through a double pointer
+
+inline __m128d load_point(const char* src)
 {
-    std::vector<Point> points_list;
+    return _mm_castsi128_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+}
 
-    if (Points.empty())
+// SSE2 is part of x86-64, one point per register
+void swap_points_sse2(double* dst, const char* src, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
     {
-        return points_list;
+        __m128d p = load_point(src + i * POINT_SIZE);
+        _mm_storeu_pd(dst + 2 * i, _mm_shuffle_pd(p, p, 1));
     }
+}
 
-    int32_t offset = Figures[figureIdx].Offset;
-
-    if (Figures.size() > figureIdx + 1)
+// two points per register, four per iteration
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx")))
+#endif
+void swap_points_avx(double* dst, const char* src, std::size_t count)
+{
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
     {
-        int32_t offsetEnd = Figures[figureIdx + 1].Offset;
-        points_list = std::vector<Point>(Points.cbegin() + offset, Points.cbegin() + offsetEnd);
+        const char* in = src + i * POINT_SIZE;
+        __m256d a = _mm256_castsi256_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in)));
+        __m256d b = _mm256_castsi256_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * POINT_SIZE)));
+        _mm256_storeu_pd(dst + 2 * i, _mm256_permute_pd(a, 0x5));
+        _mm256_storeu_pd(dst + 2 * i + 4, _mm256_permute_pd(b, 0x5));
     }
-    else
+    for (; i < count; ++i)
     {
-        points_list = std::vector<Point>(Points.cbegin() + offset, Points.cend());
+        __m128d p = load_point(src + i * POINT_SIZE);
+        _mm_storeu_pd(dst + 2 * i, _mm_shuffle_pd(p, p, 1));
     }
-    return points_list;
+    _mm256_zeroupper();
 }
 
-
-sqlgeo_reader::sqlgeo_reader(const char* data, std::size_t size)
-    : data_(data),
-      size_(size),
-      pos_(0)
+bool cpu_has_avx()
 {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    // the os must save the ymm registers on context switches
+    return osxsave && avx && (_xgetbv(0) & 0x6) == 0x6;
+#else
+    // runs from a static initializer, possibly before libgcc's own
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx");
+#endif
 }
 
-uint32_t sqlgeo_reader::read_uint32()
-{
-    std::uint32_t val;
-    if (pos_ + 4 > size_)
-    {
-        return 0;
-    }
-    auto data = data_ + pos_;
-    std::memcpy(&val, data, 4);
-    pos_ += 4;
+#endif
 
-    return val;
-}
+using swap_points_fn = void (*)(double*, const char*, std::size_t);
 
-uint16_t sqlgeo_reader::read_uint16()
+swap_points_fn select_swap_points()
 {
-    std::uint16_t val;
-    if (pos_ + 2 > size_)
-    {
-        return 0;
-    }
-    auto data = data_ + pos_;
-    std::memcpy(&val, data, 2);
-    pos_ += 2;
+#ifdef MSSQLCLR_X86_64
+    return cpu_has_avx() ? swap_points_avx : swap_points_sse2;
+#else
+    return swap_points_scalar;
+#endif
+}
+
+const swap_points_fn swap_points = select_swap_points();
 
-    return val;
 }
-uint8_t sqlgeo_reader::read_uint8()
+
+void copy_points(double* dst, const char* src, std::size_t count, bool swap_xy)
 {
-    std::uint8_t val;
-    if (pos_ + 1 > size_)
+    if (swap_xy)
     {
-        return 0;
+        swap_points(dst, src, count);
     }
-    auto data = data_ + pos_;
-    std::memcpy(&val, data, 1);
-    pos_ += 1;
-
-    return val;
-}
-double sqlgeo_reader::read_double()
-{
-    double val;
-    if (pos_ + 8 > size_)
+    else
     {
-        return 0;
+        std::memcpy(dst, src, count * POINT_SIZE);
     }
-    auto data = data_ + pos_;
-    std::memcpy(&val, &data[0], 8);
-    pos_ += 8;
-
-    return val;
 }
 
-void sqlgeo_reader::readPointsZ(std::vector<Point> points)
+Point Geometry::getPoint(uint32_t pointIdx) const
 {
-
-    if (points.empty())
+    const char* data = PointsData + pointIdx * POINT_SIZE;
+    double first = read_at<double>(data);
+    double second = read_at<double>(data + 8);
+    if (IsGeography)
     {
-        return;
+        return Point(second, first);
     }
-    for (auto& point : points)
-    {
-        point.Z = read_double();
-    }
-
+    return Point(first, second);
 }
 
-void sqlgeo_reader::readPointsM(std::vector<Point> points)
+void Geometry::copyPoints(uint32_t begin, uint32_t end, double* dst) const
 {
+    copy_points(dst, PointsData + begin * POINT_SIZE, end - begin, IsGeography);
+}
 
-    if (points.empty())
+void Geometry::getBounds(uint32_t begin, uint32_t end, double& minx, double& miny, double& maxx, double& maxy) const
+{
+    const char* data = PointsData + begin * POINT_SIZE;
+    double min0 = read_at<double>(data), max0 = min0;
+    double min1 = read_at<double>(data + 8), max1 = min1;
+    for (uint32_t i = begin + 1; i < end; ++i)
     {
-        return;
+        data += POINT_SIZE;
+        double first = read_at<double>(data);
+        double second = read_at<double>(data + 8);
+        min0 = first < min0 ? first : min0;
+        max0 = first > max0 ? first : max0;
+        min1 = second < min1 ? second : min1;
+        max1 = second > max1 ? second : max1;
     }
-    for (auto& point : points)
+    if (IsGeography)
     {
-        point.M = read_double();
+        minx = min1, miny = min0, maxx = max1, maxy = max0;
+    }
+    else
+    {
+        minx = min0, miny = min1, maxx = max0, maxy = max1;
     }
-
 }
-std::vector<Point> sqlgeo_reader::readPoints(uint32_t count, bool isGeography)
-{
-    std::vector<Point> points;
-    points.reserve(count);
 
-    if (count < 1)
+Figure Geometry::getFigure(uint32_t figureIdx) const
+{
+    if (FiguresData == nullptr)
     {
-        return std::vector<Point>();
+        return Figure(FIGURE_STROKE, 0);
     }
+    const char* data = FiguresData + figureIdx * FIGURE_SIZE;
+    return Figure((FIGURE)read_at<uint8_t>(data), read_at<uint32_t>(data + 1));
+}
 
-    for (uint32_t i = 0; i < count; i++)
+Shape Geometry::getShape(uint32_t shapeIdx) const
+{
+    if (ShapesData == nullptr)
     {
-        if (isGeography)
-        {
-            double y = read_double();
-            double x = read_double();
-            points.emplace_back(x, y);
-        }
-        else
-        {
-            double x = read_double();
-            double y = read_double();
-            points.emplace_back(x, y);
-        }
-
+        return Shape(-1, 0, Properties.P ? SHAPE_POINT : SHAPE_LINESTRING);
     }
-
-    return points;
+    const char* data = ShapesData + shapeIdx * SHAPE_SIZE;
+    return Shape(read_at<int32_t>(data), read_at<int32_t>(data + 4), (SHAPE)read_at<uint8_t>(data + 8));
 }
 
-std::vector<Figure> sqlgeo_reader::readFigures(uint32_t count, SerializationProperties properties)
+SEGMENT Geometry::getSegment(uint32_t segmentIdx) const
 {
-    std::vector<Figure> figures;
-    figures.reserve(count);
+    return (SEGMENT)read_at<uint8_t>(SegmentsData + segmentIdx);
+}
 
-    if (count == 0)
+void Geometry::getFigureRange(uint32_t shapeIdx, uint32_t& begin, uint32_t& end) const
+{
+    begin = end = 0;
+    if (NumFigures == 0)
     {
-        return figures;
+        return;
     }
-
-    if (properties.P || properties.L)
+    uint32_t offset = uint32_t(getShape(shapeIdx).FigureOffset);
+    if (offset == EMPTY_OFFSET)
     {
-        figures.emplace_back(FIGURE_STROKE, 0);
+        return;
     }
-    else
+    begin = offset;
+    end = NumFigures;
+    // empty shapes carry an offset of -1, the next non-empty shape closes the range
+    for (uint32_t i = shapeIdx + 1; i < NumShapes; ++i)
     {
-        for (uint32_t i = 0; i < count; i++)
+        uint32_t next = uint32_t(getShape(i).FigureOffset);
+        if (next != EMPTY_OFFSET)
         {
-
-            Figure f;
-            f.Attribute = (FIGURE)read_uint8();
-            f.Offset = read_uint32();
-            figures.push_back(f);
+            end = next;
+            break;
         }
     }
-    return figures;
 }
-std::vector<Shape> sqlgeo_reader::readShapes(uint32_t count, SerializationProperties properties)
+
+void Geometry::getPointRange(uint32_t figureIdx, uint32_t& begin, uint32_t& end) const
 {
-    std::vector<Shape> shapes;
-    shapes.reserve(count);
+    begin = getFigure(figureIdx).Offset;
+    end = (figureIdx + 1 < NumFigures) ? getFigure(figureIdx + 1).Offset : NumPoints;
+}
 
-    if (count < 1)
-    {
-        return shapes;
-    }
 
-    if (properties.P)
-    {
-        shapes.emplace_back(-1, 0, SHAPE_POINT);
-    }
-    else if (properties.L)
-    {
-        shapes.emplace_back(-1, 0, SHAPE_LINESTRING);
-    }
-    else
-    {
-        for (int i = 0; i < int(count); i++)
-        {
-            uint32_t parent_offset = read_uint32();
-            uint32_t figure_offset = read_uint32();
-            SHAPE type = (SHAPE)read_uint8();
-            shapes.emplace_back(parent_offset, figure_offset, type);
-        }
-    }
-    return shapes;
+sqlgeo_reader::sqlgeo_reader(const char* data, std::size_t size)
+    : data_(data),
+      size_(size),
+      pos_(0)
+{
 }
-std::vector<Segment> sqlgeo_reader::readSegments(uint32_t count)
+
+// read_* are unchecked: parseGeometry checks the room left with has() first
+bool sqlgeo_reader::has(std::size_t length) const
 {
-    std::vector<Segment> segments;
-    if (count < 1)
-    {
-        return segments;
-    }
+    return pos_ <= size_ && length <= size_ - pos_;
+}
 
-    for (int i = 0; i < int(count); i++)
+uint32_t sqlgeo_reader::read_uint32()
+{
+    uint32_t val = read_at<uint32_t>(data_ + pos_);
+    pos_ += 4;
+    return val;
+}
+
+uint8_t sqlgeo_reader::read_uint8()
+{
+    uint8_t val = read_at<uint8_t>(data_ + pos_);
+    pos_ += 1;
+    return val;
+}
+
+const char* sqlgeo_reader::read_array(uint32_t count, std::size_t item_size)
+{
+    std::size_t length = std::size_t(count) * item_size;
+    if (!has(length))
     {
-        Segment s;
-        s.Type = (SEGMENT)read_uint8();
-        segments.push_back(s);
+        return nullptr;
     }
-    return segments;
+    const char* data = data_ + pos_;
+    pos_ += length;
+    return data;
 }
 
 Geometry sqlgeo_reader::parseGeography()
@@ -247,18 +270,25 @@ Geometry sqlgeo_reader::parseGeography()
     return parseGeometry(true);
 }
 
+static Geometry invalid(Geometry& g, const char* reason)
+{
+    g.Error = reason;
+    g.NumPoints = g.NumFigures = g.NumShapes = g.NumSegments = 0;
+    return g;
+}
+
 Geometry sqlgeo_reader::parseGeometry(bool isGeography)
 {
 
     Geometry g = {};
+    g.IsGeography = isGeography;
 
-    uint32_t numberOfPoints;
-    uint32_t numberOfFigures;
-    uint32_t numberOfShapes;
-    uint32_t numberOfSegments;
-
-    g.SRID = read_uint32();
+    if (!has(6))
+    {
+        return invalid(g, "blob is shorter than the header");
+    }
 
+    g.SRID = int32_t(read_uint32());
 
     if (isGeography == true)
     {
@@ -268,25 +298,20 @@ Geometry sqlgeo_reader::parseGeometry(bool isGeography)
         }
         else if (g.SRID < 4210 || g.SRID > 4999)
         {
-            g.Properties.V = false;
-            return g;
-            //("Invalid SRID for geography");
+            return invalid(g, "invalid SRID for geography");
         }
     }
 
     //version
     g.Version = read_uint8();
 
-    if (g.Version > 2)
+    if (g.Version < 1 || g.Version > 2)
     {
-        g.Properties.V = false;
-        return g;
-        //("Version %d is not supported", g.Version);
+        return invalid(g, "unsupported serialization version");
     }
 
     //flags
-    uint8_t flags = 0;
-    flags = read_uint8();
+    uint8_t flags = read_uint8();
 
     g.Properties.Z = (flags & (1 << 0)) != 0;
     g.Properties.M = (flags & (1 << 1)) != 0;
@@ -300,12 +325,11 @@ Geometry sqlgeo_reader::parseGeometry(bool isGeography)
     }
     if (g.Properties.P && g.Properties.L)
     {
-        g.Properties.V = false;
-        return g;
-        //("geometry data is invalid");
+        return invalid(g, "both single point and single line flags are set");
     }
 
     //points
+    uint32_t numberOfPoints;
     if (g.Properties.P)
     {
         numberOfPoints = 1;
@@ -316,49 +340,135 @@ Geometry sqlgeo_reader::parseGeometry(bool isGeography)
     }
     else
     {
+        if (!has(4))
+        {
+            return invalid(g, "truncated point count");
+        }
         numberOfPoints = read_uint32();
     }
-    g.Points = readPoints(numberOfPoints, isGeography);
+    g.PointsData = read_array(numberOfPoints, POINT_SIZE);
+    if (g.PointsData == nullptr)
+    {
+        return invalid(g, "point count exceeds the blob size");
+    }
 
-    if (g.Properties.Z)
+    //z and m values are not used, skip them
+    if ((g.Properties.Z && read_array(numberOfPoints, 8) == nullptr) ||
+        (g.Properties.M && read_array(numberOfPoints, 8) == nullptr))
     {
-        readPointsZ(g.Points);
+        return invalid(g, "z/m values exceed the blob size");
     }
-    if (g.Properties.M)
+
+    //figures and shapes are implicit for a single point or line
+    uint32_t numberOfFigures = 1;
+    uint32_t numberOfShapes = 1;
+    if (!(g.Properties.P || g.Properties.L))
     {
-        readPointsM(g.Points);
+        if (!has(4))
+        {
+            return invalid(g, "truncated figure count");
+        }
+        numberOfFigures = read_uint32();
+        g.FiguresData = read_array(numberOfFigures, FIGURE_SIZE);
+        if (g.FiguresData == nullptr)
+        {
+            return invalid(g, "figure count exceeds the blob size");
+        }
+
+        if (!has(4))
+        {
+            return invalid(g, "truncated shape count");
+        }
+        numberOfShapes = read_uint32();
+        g.ShapesData = read_array(numberOfShapes, SHAPE_SIZE);
+        if (g.ShapesData == nullptr)
+        {
+            return invalid(g, "shape count exceeds the blob size");
+        }
     }
 
-    //figures
-    if (g.Properties.P || g.Properties.L)
+    //segments
+    uint32_t numberOfSegments = 0;
+    if (g.Version == 2)
     {
-        numberOfFigures = 1;
+        if (!has(4))
+        {
+            return invalid(g, "truncated segment count");
+        }
+        numberOfSegments = read_uint32();
+        g.SegmentsData = read_array(numberOfSegments, 1);
+        if (g.SegmentsData == nullptr)
+        {
+            return invalid(g, "segment count exceeds the blob size");
+        }
     }
-    else
+
+    if (pos_ != size_)
     {
-        numberOfFigures = read_uint32();
+        return invalid(g, "unexpected trailing bytes");
     }
 
-    g.Figures = readFigures(numberOfFigures, g.Properties);
+    g.NumPoints = numberOfPoints;
+    g.NumFigures = numberOfFigures;
+    g.NumShapes = numberOfShapes;
+    g.NumSegments = numberOfSegments;
 
+    const char* error = validate(g);
+    if (error != nullptr)
+    {
+        return invalid(g, error);
+    }
+    return g;
+}
 
-    //shapes
-    if (g.Properties.P || g.Properties.L)
+// Checks the offsets linking shapes to figures and figures to points, so
+// that the decoder can walk the arrays without any further bounds check.
+const char* sqlgeo_reader::validate(Geometry const& g) const
+{
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i < g.NumFigures; ++i)
     {
-        numberOfShapes = 1;
+        Figure f = g.getFigure(i);
+        if (f.Attribute > (g.Version == 1 ? FIGURE_EXTERIOR_RING : FIGURE_V2_COMPOSITE_CURVE))
+        {
+            return "invalid figure attribute";
+        }
+        if (f.Offset < previous || f.Offset > g.NumPoints)
+        {
+            return "figure point offset out of range";
+        }
+        previous = f.Offset;
     }
-    else
+
+    previous = 0;
+    for (uint32_t i = 0; i < g.NumShapes; ++i)
     {
-        numberOfShapes = read_uint32();
+        Shape s = g.getShape(i);
+        if (s.OpenGisType < SHAPE_POINT || s.OpenGisType > (g.Version == 1 ? SHAPE_GEOMETRY_COLLECTION : SHAPE_CURVE_POLYGON))
+        {
+            return "invalid shape type";
+        }
+        if (i == 0 ? s.ParentOffset != -1 : (s.ParentOffset < 0 || uint32_t(s.ParentOffset) >= i))
+        {
+            return "shape parent offset out of range";
+        }
+        if (uint32_t(s.FigureOffset) != EMPTY_OFFSET)
+        {
+            if (uint32_t(s.FigureOffset) < previous || uint32_t(s.FigureOffset) >= g.NumFigures)
+            {
+                return "shape figure offset out of range";
+            }
+            previous = uint32_t(s.FigureOffset);
+        }
     }
-    g.Shapes = readShapes(numberOfShapes, g.Properties);
 
-    //segments
-    if (g.Version == 2)
+    for (uint32_t i = 0; i < g.NumSegments; ++i)
     {
-        numberOfSegments = read_uint32();
-        g.Segments = readSegments(numberOfSegments);
+        if (g.getSegment(i) > SEGMENT_FIRST_ARC)
+        {
+            return "invalid segment type";
+        }
     }
-    return g;
+    return nullptr;
+}
 }
-}
\ No newline at end of file
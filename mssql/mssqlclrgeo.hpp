@@ -2,7 +2,7 @@
 #define MSSQL_MSSQLCLRGEO_HPP
 
 #include <cstdint>
-#include <vector>
+#include <cstddef>
 
 namespace mssqlclr {
 
@@ -90,33 +90,55 @@ struct SerializationProperties
     bool Z;
 };
 
+// Parsed header of a serialized geometry/geography.
+// Points, figures, shapes and segments are not copied: they are views over
+// the buffer given to sqlgeo_reader, which must outlive the Geometry.
 struct Geometry
 {
     int32_t SRID;
     uint8_t Version;
     SerializationProperties Properties;
+    bool IsGeography;
+    const char* Error; // why the blob was rejected, null when it is well formed
 
-    std::vector<Point> Points;
-    std::vector<Figure> Figures;
-    std::vector<Shape> Shapes;
-    std::vector<Segment> Segments;
-    const std::vector<Figure> getFiguresFromShape(int shapeIdx) const;
-    const std::vector<Point> getPointsFromFigure(int figureIdx) const;
+    uint32_t NumPoints;
+    uint32_t NumFigures;
+    uint32_t NumShapes;
+    uint32_t NumSegments;
+
+    const char* PointsData;   // 16 bytes per point (x y, or lat long for geography)
+    const char* FiguresData;  // 5 bytes per figure, null for single point/line
+    const char* ShapesData;   // 9 bytes per shape, null for single point/line
+    const char* SegmentsData; // 1 byte per segment (v2 only)
+
+    Point getPoint(uint32_t pointIdx) const;
+    Figure getFigure(uint32_t figureIdx) const;
+    Shape getShape(uint32_t shapeIdx) const;
+    SEGMENT getSegment(uint32_t segmentIdx) const;
+
+    // Copies points [begin, end) as x,y pairs to dst (2 * (end - begin) doubles)
+    void copyPoints(uint32_t begin, uint32_t end, double* dst) const;
+
+    // Bounding box of points [begin, end), begin < end
+    void getBounds(uint32_t begin, uint32_t end, double& minx, double& miny, double& maxx, double& maxy) const;
+
+    // [begin, end) ranges, begin == end for empty shapes
+    void getFigureRange(uint32_t shapeIdx, uint32_t& begin, uint32_t& end) const;
+    void getPointRange(uint32_t figureIdx, uint32_t& begin, uint32_t& end) const;
 };
 
+// Copies count serialized points to dst, swapping each pair when swap_xy is set
+// (geography stores lat/long). Uses SSE2/AVX when the cpu supports it.
+void copy_points(double* dst, const char* src, std::size_t count, bool swap_xy);
+
 class sqlgeo_reader
 {
 private:
+    bool has(std::size_t length) const;
     uint32_t read_uint32();
-    uint16_t read_uint16();
     uint8_t read_uint8();
-    double read_double();
-    void readPointsZ(std::vector<Point> points);
-    void readPointsM(std::vector<Point> points);
-    std::vector<Point> readPoints(uint32_t count, bool isGeography);
-    std::vector<Figure> readFigures(uint32_t count, SerializationProperties properties);
-    std::vector<Shape> readShapes(uint32_t count, SerializationProperties properties);
-    std::vector<Segment> readSegments(uint32_t count);
+    const char* read_array(uint32_t count, std::size_t item_size);
+    const char* validate(Geometry const& g) const;
 
     const char* data_;
     std::size_t size_;
@@ -4,28 +4,66 @@
 #include <windows.h>
 #endif
 
+#ifndef _WINDOWS
+#include <pthread.h>
+#endif
+
 #include "odbc.hpp"
 #include <mapnik/debug.hpp>
 #include <sstream>
 #include <stdexcept>
 
-Odbc::Odbc() {
+namespace {
+
+std::atomic<unsigned> fork_generation(0);
+
+#ifndef _WINDOWS
+// only async-signal-safe work here, the handles are replaced when next used
+void on_fork_child()
+{
+    fork_generation.fetch_add(1);
+}
+#endif
+
+}
+
+unsigned getForkGeneration()
+{
+    return fork_generation.load(std::memory_order_acquire);
+}
+
+Odbc::Odbc()
+    : fork_generation_(getForkGeneration())
+{
     MAPNIK_LOG_DEBUG(mssql) << "mssql: InitOdbc";
 
+#ifndef _WINDOWS
+    static const int atfork = pthread_atfork(nullptr, nullptr, on_fork_child);
+    (void)atfork;
+#endif
+
     if (SQL_SUCCESS != SQLSetEnvAttr(SQL_NULL_HANDLE, SQL_ATTR_CONNECTION_POOLING, (SQLPOINTER)SQL_CP_ONE_PER_HENV, 0))
     {
         throw std::runtime_error("Mssql Plugin: SQLSetEnvAttr SQL_ATTR_CONNECTION_POOLING failed");
     }
 
-    if (SQL_SUCCESS != SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &sqlenvhandle_))
+    allocEnvHandle();
+}
+
+void Odbc::allocEnvHandle()
+{
+    SQLHANDLE handle;
+    if (SQL_SUCCESS != SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &handle))
     {
         throw std::runtime_error("Mssql Plugin: SQLAllocHandle SQL_HANDLE_ENV failed");
     }
 
-    if (SQL_SUCCESS != SQLSetEnvAttr(sqlenvhandle_, SQL_ATTR_ODBC_VERSION, (SQLPOINTER)SQL_OV_ODBC3, 0))
+    if (SQL_SUCCESS != SQLSetEnvAttr(handle, SQL_ATTR_ODBC_VERSION, (SQLPOINTER)SQL_OV_ODBC3, 0))
     {
+        SQLFreeHandle(SQL_HANDLE_ENV, handle);
         throw std::runtime_error("Mssql Plugin: SQLSetEnvAttr SQL_ATTR_ODBC_VERSION failed");
     }
+    sqlenvhandle_ = handle;
 }
 
 Odbc::~Odbc() {   
@@ -47,6 +85,19 @@ std::shared_ptr<Odbc> Odbc::getInstance() {
 
 SQLHANDLE Odbc::getEnvHandle()
 {
+    unsigned generation = getForkGeneration();
+    if (fork_generation_.load(std::memory_order_acquire) != generation)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (fork_generation_.load(std::memory_order_relaxed) != generation)
+        {
+            // the environment of the parent is not freed, the driver could
+            // close the connections the parent still uses
+            MAPNIK_LOG_DEBUG(mssql) << "mssql: InitOdbc after fork";
+            allocEnvHandle();
+            fork_generation_.store(generation, std::memory_order_release);
+        }
+    }
     return sqlenvhandle_;
 }
 
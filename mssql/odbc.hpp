@@ -2,6 +2,8 @@
 #define ODBC_HPP
 
 #include <sqlext.h>
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <memory>
 
@@ -12,14 +14,23 @@ class Odbc
 public:
     Odbc();
     ~Odbc();
+    // a new environment is allocated in a forked process
     SQLHANDLE getEnvHandle();
     static std::shared_ptr<Odbc> getInstance();   
   
 private: 
+    void allocEnvHandle();
+
     SQLHANDLE sqlenvhandle_;
+    std::atomic<unsigned> fork_generation_;
+    std::mutex mutex_;
 
 };
 
 std::string getOdbcError(unsigned int handletype, const SQLHANDLE& handle);
 
+// Incremented in the child process by fork(): the ODBC handles, connections
+// and threads created before belong to the parent.
+unsigned getForkGeneration();
+
 #endif // ODBC_HPP
\ No newline at end of file
@@ -0,0 +1,240 @@
+#ifndef MSSQL_READAHEADRESULTSET_HPP
+#define MSSQL_READAHEADRESULTSET_HPP
+
+#include "mpmc_queue.hpp"
+#include "resultset.hpp"
+#include "row_snapshot.hpp"
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <thread>
+
+// Result set reading rows of another one on a background thread, so the
+// network round trips of SQLFetch overlap with rendering. At most max_rows
+// rows, or max_bytes bytes of row data, are buffered ahead of next(). Both
+// sides sleep while the other one is slow.
+class ReadAheadResultSet : public IResultSet, private mapnik::util::noncopyable
+{
+  public:
+    ReadAheadResultSet(std::shared_ptr<IResultSet> const& rs, std::size_t max_rows, std::size_t max_bytes, int geometry_column)
+        : rs_(rs),
+          geometry_column_(geometry_column),
+          max_rows_(max_rows > 0 ? max_rows : 1),
+          max_bytes_(max_bytes),
+          rows_(max_rows_),
+          free_rows_(max_rows_),
+          stop_(false),
+          done_(false),
+          buffered_rows_(0),
+          buffered_bytes_(0),
+          is_closed_(false)
+    {
+    }
+
+    virtual ~ReadAheadResultSet()
+    {
+        close();
+    }
+
+    virtual void close()
+    {
+        if (!is_closed_)
+        {
+            stop_.store(true, std::memory_order_release);
+            space_.notify_all();
+            if (thread_.joinable())
+            {
+                thread_.join();
+            }
+            rs_->close();
+            is_closed_ = true;
+        }
+    }
+
+    virtual int getNumFields() const
+    {
+        return row_->getNumFields();
+    }
+
+    virtual bool next()
+    {
+        // started on the first call: an asynchronous result set must not be
+        // read before its turn
+        if (!thread_.joinable() && !is_closed_)
+        {
+            thread_ = std::thread(&ReadAheadResultSet::fetch, this);
+        }
+
+        if (row_)
+        {
+            free_rows_.try_push(std::move(row_));
+            row_.reset();
+        }
+
+        for (;;)
+        {
+            // read before popping: once the fetch is done, an empty queue
+            // means every row has been taken
+            bool done = done_.load(std::memory_order_acquire);
+            if (rows_.try_pop(row_))
+            {
+                buffered_bytes_.fetch_sub(row_->size(), std::memory_order_relaxed);
+                buffered_rows_.fetch_sub(1, std::memory_order_release);
+                space_.notify_one();
+                return true;
+            }
+            if (done || is_closed_)
+            {
+                close();
+                if (error_)
+                {
+                    std::exception_ptr error = error_;
+                    error_ = nullptr;
+                    std::rethrow_exception(error);
+                }
+                return false;
+            }
+            // counted before the push, the pop may still miss it for a moment
+            rows_ready_.await([this]() {
+                return buffered_rows_.load(std::memory_order_acquire) > 0 || done_.load(std::memory_order_acquire);
+            });
+        }
+    }
+
+    virtual const std::string getFieldName(int index) const
+    {
+        return row_->getFieldName(index);
+    }
+
+    virtual int getFieldLength(int index) const
+    {
+        return row_->getFieldLength(index);
+    }
+
+    virtual int getFieldLength(const char* name) const
+    {
+        return row_->getFieldLength(name);
+    }
+
+    virtual int getTypeOID(int index) const
+    {
+        return row_->getTypeOID(index);
+    }
+
+    virtual int getTypeOID(const char* name) const
+    {
+        return row_->getTypeOID(name);
+    }
+
+    virtual const boost::optional<int> getInt(int index) const
+    {
+        return row_->getInt(index);
+    }
+
+    virtual const boost::optional<long long> getBigInt(int index) const
+    {
+        return row_->getBigInt(index);
+    }
+
+    virtual const boost::optional<double> getDouble(int index) const
+    {
+        return row_->getDouble(index);
+    }
+
+    virtual const boost::optional<float> getFloat(int index) const
+    {
+        return row_->getFloat(index);
+    }
+
+    virtual const std::string getString(int index) const
+    {
+        return row_->getString(index);
+    }
+
+    virtual const std::wstring getWString(int index) const
+    {
+        return row_->getWString(index);
+    }
+
+    virtual const std::vector<char> getBinary(int index) const
+    {
+        return row_->getBinary(index);
+    }
+
+    virtual binary_view getBinaryView(int index) const
+    {
+        return row_->getBinaryView(index);
+    }
+
+    virtual binary_view getUtf16View(int index) const
+    {
+        return row_->getUtf16View(index);
+    }
+
+  private:
+    bool full() const
+    {
+        return buffered_rows_.load(std::memory_order_acquire) >= max_rows_ ||
+               (max_bytes_ > 0 && buffered_bytes_.load(std::memory_order_relaxed) >= max_bytes_);
+    }
+
+    void fetch()
+    {
+        try
+        {
+            std::shared_ptr<const row_schema> schema;
+            for (;;)
+            {
+                // backpressure: wait for the consumer to catch up
+                space_.await([this]() { return !full() || stop_.load(std::memory_order_acquire); });
+                if (stop_.load(std::memory_order_acquire) || !rs_->next())
+                {
+                    break;
+                }
+                if (!schema)
+                {
+                    schema = std::make_shared<row_schema>(*rs_, geometry_column_);
+                }
+
+                std::unique_ptr<RowSnapshot> row;
+                if (!free_rows_.try_pop(row))
+                {
+                    row.reset(new RowSnapshot());
+                }
+                row->capture(*rs_, schema);
+                buffered_bytes_.fetch_add(row->size(), std::memory_order_relaxed);
+                buffered_rows_.fetch_add(1, std::memory_order_release);
+
+                // cannot fail, at most max_rows_ rows are buffered
+                rows_.try_push(std::move(row));
+                rows_ready_.notify_one();
+            }
+        }
+        catch (...)
+        {
+            error_ = std::current_exception();
+        }
+        done_.store(true, std::memory_order_release);
+        rows_ready_.notify_all();
+    }
+
+    std::shared_ptr<IResultSet> rs_;
+    const int geometry_column_;
+    const std::size_t max_rows_;
+    const std::size_t max_bytes_;
+    mpmc_queue<std::unique_ptr<RowSnapshot>> rows_;
+    mpmc_queue<std::unique_ptr<RowSnapshot>> free_rows_;
+    std::unique_ptr<RowSnapshot> row_;
+    std::atomic<bool> stop_;
+    std::atomic<bool> done_;
+    std::atomic<std::size_t> buffered_rows_;
+    std::atomic<std::size_t> buffered_bytes_;
+    event_count rows_ready_; // signalled by the fetch thread
+    event_count space_;      // signalled by next() and close()
+    std::exception_ptr error_;
+    std::thread thread_;
+    bool is_closed_;
+};
+
+#endif // MSSQL_READAHEADRESULTSET_HPP
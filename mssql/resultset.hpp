@@ -36,6 +36,18 @@
 #include <sql.h>
 ///#include <sqlext.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Bytes of a binary column, owned by the result set and valid until the next
+// call to getBinaryView. data is null for a null value.
+struct binary_view
+{
+    const char* data;
+    std::size_t size;
+};
+
 class IResultSet
 {
   public:
@@ -56,14 +68,19 @@ class IResultSet
     virtual const std::string getString(int index) const = 0;
     virtual const std::wstring getWString(int index) const = 0;
     virtual const std::vector<char> getBinary(int index) const = 0;
+    virtual binary_view getBinaryView(int index) const = 0;
+    virtual binary_view getUtf16View(int index) const = 0;
 };
 
 class ResultSet : public IResultSet, private mapnik::util::noncopyable
 {
   public:
-    ResultSet(SQLHANDLE res)
+    // keep_handle: the statement belongs to a connection that executes it
+    // again, only its cursor is closed
+    ResultSet(SQLHANDLE res, bool keep_handle = false)
         : res_(res),
-          is_closed_(false)
+          is_closed_(false),
+          keep_handle_(keep_handle)
     {
     }
 
@@ -71,7 +88,14 @@ class ResultSet : public IResultSet, private mapnik::util::noncopyable
     {
         if (!is_closed_)
         {
-            SQLFreeHandle(SQL_HANDLE_STMT, res_);
+            if (keep_handle_)
+            {
+                SQLFreeStmt(res_, SQL_CLOSE);
+            }
+            else
+            {
+                SQLFreeHandle(SQL_HANDLE_STMT, res_);
+            }
             is_closed_ = true;
         }
     }
@@ -81,6 +105,16 @@ class ResultSet : public IResultSet, private mapnik::util::noncopyable
         close();
     }
 
+    // stops the server sending the rows left, closing the statement would
+    // otherwise read them all
+    void cancel()
+    {
+        if (!is_closed_)
+        {
+            SQLCancel(res_);
+        }
+    }
+
     virtual int getNumFields() const
     {
         SQLSMALLINT column_count;
@@ -368,37 +402,81 @@ class ResultSet : public IResultSet, private mapnik::util::noncopyable
 
     virtual const std::vector<char> getBinary(int index) const
     {
-        SQLLEN length = 0;
-        SQLRETURN retcode;
-        std::string value;
-        char bit[1];
+        binary_view value = getBinaryView(index);
+        return std::vector<char>(value.data, value.data + value.size);
+    }
 
-        retcode = SQLGetData(res_, index + 1, SQL_C_BINARY, bit, 0, &length);
-        if (retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO)
-        {
-            if (length != SQL_NULL_DATA)
-            {
+    virtual binary_view getBinaryView(int index) const
+    {
+        return getDataView(index, SQL_C_BINARY, 0, binary_buffer_);
+    }
 
-                std::vector<char> binvalue(length, 0);
-                retcode = SQLGetData(res_, index + 1, SQL_C_BINARY, (SQLPOINTER)&binvalue[0], length, &length);
-                if (retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO)
-                {
-                    return binvalue;
-                }
-            }
+    // nvarchar values as UTF-16 code units, without terminator. Drivers with
+    // a 4 byte SQLWCHAR get the column bytes, which are UTF-16LE.
+    virtual binary_view getUtf16View(int index) const
+    {
+        if (sizeof(SQLWCHAR) != 2)
+        {
+            return getDataView(index, SQL_C_BINARY, 0, utf16_buffer_);
         }
-        else
+        return getDataView(index, SQL_C_WCHAR, sizeof(SQLWCHAR), utf16_buffer_);
+    }
+
+  protected:
+    // reads into a buffer kept for the whole result set: one SQLGetData call
+    // when the value fits, one more to read the rest once its size is known,
+    // and doubling chunks for drivers answering SQL_NO_TOTAL
+    binary_view getDataView(int index, SQLSMALLINT c_type, std::size_t terminator, std::vector<char>& buffer) const
+    {
+        if (buffer.empty())
         {
-            std::string errormsg = getOdbcError(SQL_HANDLE_STMT, res_);
-            MAPNIK_LOG_ERROR(mssql) << "getBinary error: " << errormsg;
+            buffer.resize(16384);
         }
 
-        return std::vector<char>();
+        std::size_t size = 0;
+        for (;;)
+        {
+            SQLLEN length = 0;
+            SQLRETURN retcode = SQLGetData(res_, index + 1, c_type, (SQLPOINTER)&buffer[size], buffer.size() - size, &length);
+            if (retcode == SQL_NO_DATA)
+            {
+                break;
+            }
+            if (!(retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO))
+            {
+                std::string errormsg = getOdbcError(SQL_HANDLE_STMT, res_);
+                MAPNIK_LOG_ERROR(mssql) << "getBinary error: " << errormsg;
+                return binary_view{nullptr, 0};
+            }
+            if (length == SQL_NULL_DATA)
+            {
+                return binary_view{nullptr, 0};
+            }
+            if (retcode == SQL_SUCCESS)
+            {
+                size += length;
+                break;
+            }
+
+            // truncated, length is what was left before this call and the
+            // driver kept room for the terminator
+            std::size_t needed = length == SQL_NO_TOTAL ? 0 : size + length + terminator;
+            std::size_t read = buffer.size() - size - terminator;
+            if (terminator > 0)
+            {
+                read -= read % terminator;
+            }
+            size += read;
+            buffer.resize(std::max(needed, buffer.size() * 2));
+        }
+        return binary_view{buffer.data(), size};
     }
 
-  private:
     SQLHANDLE res_;
     bool is_closed_;
+    bool keep_handle_;
+    mutable std::vector<char> binary_buffer_;
+    mutable std::vector<char> utf16_buffer_;
 };
 
 #endif // MSSQL_RESULTSET_HPP
@@ -0,0 +1,265 @@
+#ifndef MSSQL_ROW_SNAPSHOT_HPP
+#define MSSQL_ROW_SNAPSHOT_HPP
+
+#include "resultset.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Names and types of the columns of a result set, read once
+struct row_schema
+{
+    enum kind
+    {
+        UNKNOWN,
+        INTEGER,
+        REAL,
+        STRING,
+        UTF16,
+        BINARY
+    };
+
+    // the geometry column is read as binary
+    explicit row_schema(IResultSet const& rs, int geometry_column = 0)
+    {
+        int count = rs.getNumFields();
+        names.reserve(count);
+        types.reserve(count);
+        kinds.reserve(count);
+        for (int i = 0; i < count; ++i)
+        {
+            names.push_back(rs.getFieldName(i));
+            types.push_back(rs.getTypeOID(i));
+            kinds.push_back(i == geometry_column ? BINARY : kind_of(types.back()));
+        }
+    }
+
+    static kind kind_of(int type)
+    {
+        switch (type)
+        {
+        case SQL_BIT:
+        case SQL_SMALLINT:
+        case SQL_TINYINT:
+        case SQL_INTEGER:
+        case SQL_BIGINT:
+            return INTEGER;
+        case SQL_FLOAT:
+        case SQL_REAL:
+        case SQL_DOUBLE:
+        case SQL_DECIMAL:
+        case SQL_NUMERIC:
+            return REAL;
+        case SQL_CHAR:
+        case SQL_VARCHAR:
+        case SQL_LONGVARCHAR:
+            return STRING;
+        case SQL_WCHAR:
+        case SQL_WVARCHAR:
+        case SQL_WLONGVARCHAR:
+            return UTF16;
+        default:
+            return UNKNOWN;
+        }
+    }
+
+    std::vector<std::string> names;
+    std::vector<int> types;
+    std::vector<kind> kinds;
+};
+
+// Copy of the current row of a result set, so it can be decoded on another
+// thread once the cursor has moved on. Buffers are kept when a snapshot is
+// reused for another row.
+class RowSnapshot : public IResultSet, private mapnik::util::noncopyable
+{
+  public:
+    RowSnapshot() {}
+
+    void capture(IResultSet const& rs, std::shared_ptr<const row_schema> const& schema)
+    {
+        schema_ = schema;
+        std::size_t count = schema_->kinds.size();
+        values_.resize(count);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            value& v = values_[i];
+            v.is_null = false;
+            switch (schema_->kinds[i])
+            {
+            case row_schema::INTEGER:
+            {
+                boost::optional<long long> val = rs.getBigInt(int(i));
+                v.is_null = !val;
+                v.integer = val ? *val : 0;
+                break;
+            }
+            case row_schema::REAL:
+            {
+                boost::optional<double> val = rs.getDouble(int(i));
+                v.is_null = !val;
+                v.real = val ? *val : 0;
+                break;
+            }
+            case row_schema::STRING:
+            {
+                std::string val = rs.getString(int(i));
+                v.bytes.assign(val.begin(), val.end());
+                break;
+            }
+            case row_schema::UTF16:
+            {
+                binary_view val = rs.getUtf16View(int(i));
+                v.bytes.assign(val.data, val.data + val.size);
+                break;
+            }
+            case row_schema::BINARY:
+            {
+                binary_view val = rs.getBinaryView(int(i));
+                v.bytes.assign(val.data, val.data + val.size);
+                break;
+            }
+            default:
+                v.is_null = true;
+                break;
+            }
+        }
+    }
+
+    // bytes held by the values of the row
+    std::size_t size() const
+    {
+        std::size_t size = values_.size() * sizeof(value);
+        for (auto const& v : values_)
+        {
+            size += v.bytes.size();
+        }
+        return size;
+    }
+
+    virtual void close() {}
+
+    virtual int getNumFields() const
+    {
+        return int(values_.size());
+    }
+
+    // a snapshot holds a single row, it is already positioned on it
+    virtual bool next()
+    {
+        return false;
+    }
+
+    virtual const std::string getFieldName(int index) const
+    {
+        return schema_->names[index];
+    }
+
+    virtual int getFieldLength(int index) const
+    {
+        return int(values_[index].bytes.size());
+    }
+
+    virtual int getFieldLength(const char* name) const
+    {
+        throw mapnik::datasource_exception("RowSnapshot getFieldLength not implemented");
+    }
+
+    virtual int getTypeOID(int index) const
+    {
+        return schema_->types[index];
+    }
+
+    virtual int getTypeOID(const char* name) const
+    {
+        throw mapnik::datasource_exception("RowSnapshot getTypeOID(const char* name) not implemented");
+    }
+
+    virtual const boost::optional<int> getInt(int index) const
+    {
+        value const& v = values_[index];
+        if (v.is_null || !is_number(index))
+        {
+            return boost::optional<int>();
+        }
+        return schema_->kinds[index] == row_schema::INTEGER ? int(v.integer) : int(v.real);
+    }
+
+    virtual const boost::optional<long long> getBigInt(int index) const
+    {
+        value const& v = values_[index];
+        if (v.is_null || !is_number(index))
+        {
+            return boost::optional<long long>();
+        }
+        return schema_->kinds[index] == row_schema::INTEGER ? v.integer : (long long)(v.real);
+    }
+
+    virtual const boost::optional<double> getDouble(int index) const
+    {
+        value const& v = values_[index];
+        if (v.is_null || !is_number(index))
+        {
+            return boost::optional<double>();
+        }
+        return schema_->kinds[index] == row_schema::INTEGER ? double(v.integer) : v.real;
+    }
+
+    virtual const boost::optional<float> getFloat(int index) const
+    {
+        boost::optional<double> val = getDouble(index);
+        if (!val)
+        {
+            return boost::optional<float>();
+        }
+        return float(*val);
+    }
+
+    virtual const std::string getString(int index) const
+    {
+        std::vector<char> const& bytes = values_[index].bytes;
+        return std::string(bytes.begin(), bytes.end());
+    }
+
+    virtual const std::wstring getWString(int index) const
+    {
+        throw mapnik::datasource_exception("RowSnapshot getWString not implemented");
+    }
+
+    virtual const std::vector<char> getBinary(int index) const
+    {
+        return values_[index].bytes;
+    }
+
+    virtual binary_view getBinaryView(int index) const
+    {
+        std::vector<char> const& bytes = values_[index].bytes;
+        return binary_view{bytes.data(), bytes.size()};
+    }
+
+    virtual binary_view getUtf16View(int index) const
+    {
+        return getBinaryView(index);
+    }
+
+  private:
+    struct value
+    {
+        bool is_null;
+        long long integer;
+        double real;
+        std::vector<char> bytes;
+    };
+
+    bool is_number(int index) const
+    {
+        row_schema::kind kind = schema_->kinds[index];
+        return kind == row_schema::INTEGER || kind == row_schema::REAL;
+    }
+
+    std::shared_ptr<const row_schema> schema_;
+    std::vector<value> values_;
+};
+
+#endif // MSSQL_ROW_SNAPSHOT_HPP
@@ -0,0 +1,82 @@
+#ifndef MSSQL_SQL_PARAMETERS_HPP
+#define MSSQL_SQL_PARAMETERS_HPP
+
+#include <mapnik/datasource.hpp>
+
+#include "odbc.hpp"
+#include <sql.h>
+#include <sqlext.h>
+
+#include <string>
+#include <vector>
+
+// Values bound to the ? markers of a statement, in the order of the markers.
+// Numbers are sent as float, texts as varchar(8000) so that the parameter
+// declarations, and so the server plan, do not change with the values.
+class sql_parameters
+{
+  public:
+    void add(double value)
+    {
+        values_.push_back(parameter{false, value, std::string()});
+    }
+
+    void add(std::string const& text)
+    {
+        values_.push_back(parameter{true, 0.0, text});
+    }
+
+    bool empty() const
+    {
+        return values_.empty();
+    }
+
+    std::size_t size() const
+    {
+        return values_.size();
+    }
+
+    // the driver reads the values when the statement is executed, they must
+    // not be changed before
+    void bind(SQLHANDLE hstmt)
+    {
+        const std::size_t max_varchar = 8000;
+        lengths_.resize(values_.size());
+        for (std::size_t i = 0; i < values_.size(); ++i)
+        {
+            parameter& value = values_[i];
+            SQLRETURN retcode;
+            if (value.is_text)
+            {
+                lengths_[i] = SQLLEN(value.text.size());
+                retcode = SQLBindParameter(hstmt, SQLUSMALLINT(i + 1), SQL_PARAM_INPUT, SQL_C_CHAR,
+                                           value.text.size() <= max_varchar ? SQL_VARCHAR : SQL_LONGVARCHAR,
+                                           value.text.size() <= max_varchar ? max_varchar : value.text.size(), 0,
+                                           (SQLPOINTER)value.text.data(), SQLLEN(value.text.size()), &lengths_[i]);
+            }
+            else
+            {
+                lengths_[i] = 0;
+                retcode = SQLBindParameter(hstmt, SQLUSMALLINT(i + 1), SQL_PARAM_INPUT, SQL_C_DOUBLE, SQL_DOUBLE,
+                                           0, 0, &value.number, 0, &lengths_[i]);
+            }
+            if (!(retcode == SQL_SUCCESS || retcode == SQL_SUCCESS_WITH_INFO))
+            {
+                throw mapnik::datasource_exception("Mssql Plugin: SQLBindParameter error: " + getOdbcError(SQL_HANDLE_STMT, hstmt));
+            }
+        }
+    }
+
+  private:
+    struct parameter
+    {
+        bool is_text;
+        double number;
+        std::string text;
+    };
+
+    std::vector<parameter> values_;
+    std::vector<SQLLEN> lengths_;
+};
+
+#endif // MSSQL_SQL_PARAMETERS_HPP
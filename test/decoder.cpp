@@ -0,0 +1,726 @@
+/*****************************************************************************
+ *
+ * Server independent tests of the geometry decoder, its clipping and
+ * simplification, and the string intern cache.
+ *
+ * The corpus written by bench/make_corpus.py is read from bench/corpus, or
+ * from MSSQL_CORPUS_PATH. Run just these tests with: ./test/run "[decoder]"
+ *
+ *****************************************************************************/
+
+#include "catch.hpp"
+
+#include "../mssql/geoclr_reader.hpp"
+#include "../mssql/intern_cache.hpp"
+#include "../mssql/mssqlclrgeo.hpp"
+
+// mapnik
+#include <mapnik/geometry.hpp>
+#include <mapnik/wkb.hpp>
+
+// stl
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::string const MSSQL_CORPUS_PATH = (std::getenv("MSSQL_CORPUS_PATH") == nullptr) ?
+    "bench/corpus" :
+    std::getenv("MSSQL_CORPUS_PATH");
+
+struct corpus_entry
+{
+    std::string name;
+    bool is_geography;
+    std::vector<char> clr;
+    std::vector<char> wkb;
+};
+
+bool read_file(std::string const& path, std::vector<char>& data)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+std::vector<corpus_entry> load_corpus()
+{
+    std::vector<corpus_entry> corpus;
+    std::ifstream index((MSSQL_CORPUS_PATH + "/index.txt").c_str());
+    std::string name, kind;
+    while (index >> name >> kind)
+    {
+        corpus_entry entry;
+        entry.name = name;
+        entry.is_geography = kind == "geography";
+        if (read_file(MSSQL_CORPUS_PATH + "/" + name + ".clr", entry.clr))
+        {
+            read_file(MSSQL_CORPUS_PATH + "/" + name + ".wkb", entry.wkb);
+            corpus.push_back(std::move(entry));
+        }
+    }
+    return corpus;
+}
+
+typedef mapnik::geometry::geometry<double> geometry_type;
+
+template <typename Line>
+bool same_points(Line const& a, Line const& b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    for (std::size_t i = 0; i < a.size(); ++i)
+    {
+        if (a[i].x != b[i].x || a[i].y != b[i].y)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool same_polygon(mapnik::geometry::polygon<double> const& a, mapnik::geometry::polygon<double> const& b)
+{
+    if (!same_points(a.exterior_ring, b.exterior_ring) || a.interior_rings.size() != b.interior_rings.size())
+    {
+        return false;
+    }
+    for (std::size_t i = 0; i < a.interior_rings.size(); ++i)
+    {
+        if (!same_points(a.interior_rings[i], b.interior_rings[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool same_geometry(geometry_type const& a, geometry_type const& b);
+
+// compares the geometry visited with expected_, vertex by vertex
+struct same_geometry_visitor
+{
+    explicit same_geometry_visitor(geometry_type const& expected)
+        : expected_(expected) {}
+
+    bool operator()(mapnik::geometry::geometry_empty const&) const
+    {
+        return expected_.is<mapnik::geometry::geometry_empty>();
+    }
+
+    bool operator()(mapnik::geometry::point<double> const& pt) const
+    {
+        if (!expected_.is<mapnik::geometry::point<double>>())
+        {
+            return false;
+        }
+        auto const& expected = mapnik::util::get<mapnik::geometry::point<double>>(expected_);
+        return pt.x == expected.x && pt.y == expected.y;
+    }
+
+    bool operator()(mapnik::geometry::line_string<double> const& line) const
+    {
+        return expected_.is<mapnik::geometry::line_string<double>>() &&
+               same_points(line, mapnik::util::get<mapnik::geometry::line_string<double>>(expected_));
+    }
+
+    bool operator()(mapnik::geometry::polygon<double> const& poly) const
+    {
+        return expected_.is<mapnik::geometry::polygon<double>>() &&
+               same_polygon(poly, mapnik::util::get<mapnik::geometry::polygon<double>>(expected_));
+    }
+
+    bool operator()(mapnik::geometry::multi_point<double> const& multi_point) const
+    {
+        return expected_.is<mapnik::geometry::multi_point<double>>() &&
+               same_points(multi_point, mapnik::util::get<mapnik::geometry::multi_point<double>>(expected_));
+    }
+
+    bool operator()(mapnik::geometry::multi_line_string<double> const& multi_line) const
+    {
+        if (!expected_.is<mapnik::geometry::multi_line_string<double>>())
+        {
+            return false;
+        }
+        auto const& expected = mapnik::util::get<mapnik::geometry::multi_line_string<double>>(expected_);
+        if (multi_line.size() != expected.size())
+        {
+            return false;
+        }
+        for (std::size_t i = 0; i < multi_line.size(); ++i)
+        {
+            if (!same_points(multi_line[i], expected[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool operator()(mapnik::geometry::multi_polygon<double> const& multi_poly) const
+    {
+        if (!expected_.is<mapnik::geometry::multi_polygon<double>>())
+        {
+            return false;
+        }
+        auto const& expected = mapnik::util::get<mapnik::geometry::multi_polygon<double>>(expected_);
+        if (multi_poly.size() != expected.size())
+        {
+            return false;
+        }
+        for (std::size_t i = 0; i < multi_poly.size(); ++i)
+        {
+            if (!same_polygon(multi_poly[i], expected[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool operator()(mapnik::geometry::geometry_collection<double> const& collection) const
+    {
+        if (!expected_.is<mapnik::geometry::geometry_collection<double>>())
+        {
+            return false;
+        }
+        auto const& expected = mapnik::util::get<mapnik::geometry::geometry_collection<double>>(expected_);
+        if (collection.size() != expected.size())
+        {
+            return false;
+        }
+        for (std::size_t i = 0; i < collection.size(); ++i)
+        {
+            if (!same_geometry(collection[i], expected[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+    geometry_type const& expected_;
+};
+
+bool same_geometry(geometry_type const& a, geometry_type const& b)
+{
+    return mapnik::util::apply_visitor(same_geometry_visitor(b), a);
+}
+
+// checks every ring of the geometry visited and counts their vertices
+struct ring_check_visitor
+{
+    mutable std::size_t ring_vertices = 0;
+
+    void operator()(mapnik::geometry::geometry_empty const&) const {}
+    void operator()(mapnik::geometry::point<double> const&) const {}
+    void operator()(mapnik::geometry::multi_point<double> const&) const {}
+
+    void operator()(mapnik::geometry::line_string<double> const& line) const
+    {
+        CHECK(line.size() >= 2);
+    }
+
+    void operator()(mapnik::geometry::multi_line_string<double> const& multi_line) const
+    {
+        for (auto const& line : multi_line)
+        {
+            (*this)(line);
+        }
+    }
+
+    void operator()(mapnik::geometry::polygon<double> const& poly) const
+    {
+        check_ring(poly.exterior_ring);
+        ring_vertices += poly.exterior_ring.size();
+        for (auto const& hole : poly.interior_rings)
+        {
+            check_ring(hole);
+            ring_vertices += hole.size();
+        }
+    }
+
+    void operator()(mapnik::geometry::multi_polygon<double> const& multi_poly) const
+    {
+        for (auto const& poly : multi_poly)
+        {
+            (*this)(poly);
+        }
+    }
+
+    void operator()(mapnik::geometry::geometry_collection<double> const& collection) const
+    {
+        for (auto const& geom : collection)
+        {
+            mapnik::util::apply_visitor(*this, geom);
+        }
+    }
+
+    static void check_ring(mapnik::geometry::linear_ring<double> const& ring)
+    {
+        REQUIRE(ring.size() >= 4);
+        CHECK(ring.front().x == ring.back().x);
+        CHECK(ring.front().y == ring.back().y);
+    }
+};
+
+template <typename T>
+void write_at(std::vector<char>& blob, std::size_t pos, T value)
+{
+    std::memcpy(blob.data() + pos, &value, sizeof(T));
+}
+
+mssqlclr::Geometry parse(std::vector<char> const& blob, bool is_geography = false)
+{
+    mssqlclr::sqlgeo_reader reader(blob.data(), blob.size());
+    return reader.parseGeometry(is_geography);
+}
+
+mapnik::geometry::linear_ring<double> make_ring(std::vector<std::pair<double, double>> const& coords)
+{
+    mapnik::geometry::linear_ring<double> ring;
+    for (auto const& c : coords)
+    {
+        ring.emplace_back(c.first, c.second);
+    }
+    return ring;
+}
+
+mapnik::geometry::line_string<double> make_line(std::vector<std::pair<double, double>> const& coords)
+{
+    mapnik::geometry::line_string<double> line;
+    for (auto const& c : coords)
+    {
+        line.emplace_back(c.first, c.second);
+    }
+    return line;
+}
+
+}
+
+TEST_CASE("mssql-decoder", "[decoder]") {
+
+    std::vector<corpus_entry> corpus = load_corpus();
+    REQUIRE(!corpus.empty());
+
+    SECTION("corpus decodes like its WKB")
+    {
+        // rings as stored, the WKB is not reoriented either
+        geometry_decode_options options;
+        options.trust_orientation = true;
+        for (auto const& entry : corpus)
+        {
+            if (entry.wkb.empty())
+            {
+                continue;
+            }
+            INFO(entry.name);
+            geometry_type expected = mapnik::geometry_utils::from_wkb(entry.wkb.data(), entry.wkb.size());
+            geometry_type geom = from_geoclr(entry.clr.data(), entry.clr.size(), entry.is_geography, options);
+            CHECK(same_geometry(geom, expected));
+
+            // points are read from wherever the driver put them
+            std::vector<char> unaligned(entry.clr.size() + 1);
+            std::memcpy(unaligned.data() + 1, entry.clr.data(), entry.clr.size());
+            geom = from_geoclr(unaligned.data() + 1, entry.clr.size(), entry.is_geography, options);
+            CHECK(same_geometry(geom, expected));
+        }
+    }
+
+    SECTION("curves are linearized")
+    {
+        for (auto const& entry : corpus)
+        {
+            if (!entry.wkb.empty())
+            {
+                continue;
+            }
+            INFO(entry.name);
+            geometry_type geom = from_geoclr(entry.clr.data(), entry.clr.size(), entry.is_geography);
+            if (geom.is<mapnik::geometry::line_string<double>>())
+            {
+                auto const& line = mapnik::util::get<mapnik::geometry::line_string<double>>(geom);
+                CHECK(line.size() > 5);
+            }
+            else
+            {
+                REQUIRE(geom.is<mapnik::geometry::polygon<double>>());
+                ring_check_visitor()(mapnik::util::get<mapnik::geometry::polygon<double>>(geom));
+            }
+        }
+    }
+
+    SECTION("truncated blobs are rejected")
+    {
+        for (auto const& entry : corpus)
+        {
+            INFO(entry.name);
+            std::vector<std::size_t> sizes;
+            for (std::size_t size = 0; size < entry.clr.size() && size < 64; ++size)
+            {
+                sizes.push_back(size);
+            }
+            sizes.push_back(entry.clr.size() / 2);
+            sizes.push_back(entry.clr.size() - 1);
+            for (std::size_t size : sizes)
+            {
+                INFO(size);
+                std::vector<char> blob(entry.clr.begin(), entry.clr.begin() + size);
+                CHECK(parse(blob, entry.is_geography).Error != nullptr);
+                CHECK(from_geoclr(blob.data(), blob.size(), entry.is_geography).is<mapnik::geometry::geometry_empty>());
+            }
+        }
+    }
+
+    SECTION("malformed blobs are rejected")
+    {
+        std::vector<char> line;
+        for (auto const& entry : corpus)
+        {
+            if (entry.name == "linestring_1k")
+            {
+                line = entry.clr;
+            }
+        }
+        REQUIRE(!line.empty());
+        REQUIRE(parse(line).Error == nullptr);
+
+        // srid, version, flags, point count, points, figure count, figures,
+        // shape count, shapes
+        uint32_t points;
+        std::memcpy(&points, line.data() + 6, 4);
+        std::size_t figures = 10 + 16 * std::size_t(points) + 4;
+        std::size_t shapes = figures + 5 + 4;
+
+        std::vector<char> blob = line;
+        blob[4] = 3;
+        CHECK(parse(blob).Error != nullptr);
+
+        blob = line;
+        blob[5] |= 0x08 | 0x10;
+        CHECK(parse(blob).Error != nullptr);
+
+        blob = line;
+        write_at<uint32_t>(blob, 6, points + 2);
+        CHECK(parse(blob).Error != nullptr);
+
+        blob = line;
+        write_at<uint32_t>(blob, 6, 0xffffffff);
+        CHECK(parse(blob).Error != nullptr);
+
+        blob = line;
+        blob[figures] = 7;
+        CHECK(parse(blob).Error != nullptr);
+
+        blob = line;
+        write_at<uint32_t>(blob, figures + 1, points + 1);
+        CHECK(parse(blob).Error != nullptr);
+
+        blob = line;
+        write_at<int32_t>(blob, shapes, 0);
+        CHECK(parse(blob).Error != nullptr);
+
+        blob = line;
+        write_at<int32_t>(blob, shapes + 4, 1);
+        CHECK(parse(blob).Error != nullptr);
+
+        blob = line;
+        blob[shapes + 8] = 0x0B;
+        CHECK(parse(blob).Error != nullptr);
+
+        blob = line;
+        blob.push_back(0);
+        CHECK(parse(blob).Error != nullptr);
+        CHECK(from_geoclr(blob.data(), blob.size(), false).is<mapnik::geometry::geometry_empty>());
+
+        // geography srids are 4210 to 4999
+        blob = line;
+        write_at<int32_t>(blob, 0, 3857);
+        CHECK(parse(blob, true).Error != nullptr);
+    }
+}
+
+TEST_CASE("mssql-clip", "[decoder]") {
+
+    mapnik::box2d<double> box(0, 0, 10, 10);
+
+    SECTION("ring inside the box is unchanged")
+    {
+        auto ring = make_ring({ { 1, 1 }, { 9, 1 }, { 9, 9 }, { 1, 9 }, { 1, 1 } });
+        auto expected = ring;
+        CHECK(geometry_clip::relate(box, ring) == geometry_clip::INSIDE);
+        geometry_clip::clip_ring(ring, box);
+        CHECK(same_points(ring, expected));
+    }
+
+    SECTION("ring around the box becomes the box")
+    {
+        auto ring = make_ring({ { -5, -5 }, { 15, -5 }, { 15, 15 }, { -5, 15 }, { -5, -5 } });
+        geometry_clip::clip_ring(ring, box);
+        REQUIRE(ring.size() == 5);
+        for (auto const& pt : ring)
+        {
+            CHECK((pt.x == 0 || pt.x == 10));
+            CHECK((pt.y == 0 || pt.y == 10));
+        }
+        CHECK(ring.front().x == ring.back().x);
+        CHECK(ring.front().y == ring.back().y);
+    }
+
+    SECTION("ring outside the box is emptied")
+    {
+        auto ring = make_ring({ { 20, 20 }, { 30, 20 }, { 30, 30 }, { 20, 20 } });
+        CHECK(geometry_clip::relate(box, ring) == geometry_clip::DISJOINT);
+        geometry_clip::clip_ring(ring, box);
+        CHECK(ring.empty());
+    }
+
+    SECTION("ring crossing an edge is cut on it and closed")
+    {
+        auto ring = make_ring({ { 5, 2 }, { 15, 2 }, { 15, 8 }, { 5, 8 } });
+        geometry_clip::clip_ring(ring, box);
+        REQUIRE(ring.size() == 5);
+        auto expected = make_ring({ { 5, 2 }, { 10, 2 }, { 10, 8 }, { 5, 8 }, { 5, 2 } });
+        CHECK(same_points(ring, expected));
+    }
+
+    SECTION("ring only touching the box is emptied")
+    {
+        auto ring = make_ring({ { 10, 0 }, { 20, 0 }, { 20, 10 }, { 10, 0 } });
+        geometry_clip::clip_ring(ring, box);
+        CHECK(ring.empty());
+    }
+
+    SECTION("holes outside the box are dropped")
+    {
+        mapnik::geometry::polygon<double> poly;
+        poly.exterior_ring = make_ring({ { -5, -5 }, { 25, -5 }, { 25, 25 }, { -5, 25 }, { -5, -5 } });
+        poly.interior_rings.push_back(make_ring({ { 20, 20 }, { 21, 20 }, { 21, 21 }, { 20, 20 } }));
+        poly.interior_rings.push_back(make_ring({ { 2, 2 }, { 3, 2 }, { 3, 3 }, { 2, 2 } }));
+        REQUIRE(geometry_clip::clip_polygon(poly, box));
+        REQUIRE(poly.interior_rings.size() == 1);
+        CHECK(poly.interior_rings[0][0].x == 2);
+    }
+
+    SECTION("line crossing the box keeps its inside part")
+    {
+        mapnik::geometry::multi_line_string<double> parts;
+        geometry_clip::clip_line(make_line({ { -5, 5 }, { 15, 5 } }), box, parts);
+        REQUIRE(parts.size() == 1);
+        CHECK(same_points(parts[0], make_line({ { 0, 5 }, { 10, 5 } })));
+    }
+
+    SECTION("line leaving and entering the box is split")
+    {
+        mapnik::geometry::multi_line_string<double> parts;
+        geometry_clip::clip_line(make_line({ { 2, 2 }, { 2, 20 }, { 8, 20 }, { 8, 2 } }), box, parts);
+        REQUIRE(parts.size() == 2);
+        CHECK(same_points(parts[0], make_line({ { 2, 2 }, { 2, 10 } })));
+        CHECK(same_points(parts[1], make_line({ { 8, 10 }, { 8, 2 } })));
+    }
+
+    SECTION("line along an edge is kept")
+    {
+        mapnik::geometry::multi_line_string<double> parts;
+        geometry_clip::clip_line(make_line({ { 0, -5 }, { 0, 15 } }), box, parts);
+        REQUIRE(parts.size() == 1);
+        CHECK(same_points(parts[0], make_line({ { 0, 0 }, { 0, 10 } })));
+    }
+
+    SECTION("lines outside the box or without a segment give no part")
+    {
+        mapnik::geometry::multi_line_string<double> parts;
+        geometry_clip::clip_line(make_line({ { 11, -5 }, { 11, 15 } }), box, parts);
+        geometry_clip::clip_line(make_line({ { -5, 12 }, { 15, 12 } }), box, parts);
+        geometry_clip::clip_line(make_line({ { 5, 5 } }), box, parts);
+        geometry_clip::clip_line(make_line({}), box, parts);
+        CHECK(parts.empty());
+    }
+
+    SECTION("fully clipped multi geometries are empty")
+    {
+        mapnik::geometry::multi_polygon<double> multi_poly;
+        multi_poly.emplace_back();
+        multi_poly.back().exterior_ring = make_ring({ { 20, 20 }, { 30, 20 }, { 30, 30 }, { 20, 20 } });
+        multi_poly.emplace_back();
+        multi_poly.back().exterior_ring = make_ring({ { 10, 0 }, { 20, 0 }, { 20, 10 }, { 10, 0 } });
+        mapnik::geometry::multi_line_string<double> multi_line;
+        multi_line.push_back(make_line({ { 11, -5 }, { 11, 15 } }));
+        multi_line.push_back(make_line({ { -5, 12 }, { 15, 12 } }));
+
+        CHECK(geometry_clip::clip(geometry_type(multi_poly), box).is<mapnik::geometry::geometry_empty>());
+        CHECK(geometry_clip::clip(geometry_type(multi_line), box).is<mapnik::geometry::geometry_empty>());
+
+        // the clipped away members are dropped from a collection
+        mapnik::geometry::geometry_collection<double> collection;
+        collection.push_back(multi_poly);
+        collection.push_back(mapnik::geometry::point<double>(5, 5));
+        collection.push_back(multi_line);
+        geometry_type clipped = geometry_clip::clip(geometry_type(collection), box);
+        REQUIRE(clipped.is<mapnik::geometry::geometry_collection<double>>());
+        auto const& members = clipped.get<mapnik::geometry::geometry_collection<double>>();
+        REQUIRE(members.size() == 1);
+        CHECK(members.front().is<mapnik::geometry::point<double>>());
+
+        collection.erase(collection.begin() + 1);
+        CHECK(geometry_clip::clip(geometry_type(collection), box).is<mapnik::geometry::geometry_empty>());
+
+        // decoded with a clip box away from every part
+        for (auto const& entry : load_corpus())
+        {
+            if (entry.name != "multipolygon_500_parts")
+            {
+                continue;
+            }
+            geometry_decode_options options;
+            options.clip = true;
+            options.clip_box = mapnik::box2d<double>(1e6, 1e6, 1e6 + 1, 1e6 + 1);
+            geometry_type geom = from_geoclr(entry.clr.data(), entry.clr.size(), entry.is_geography, options);
+            CHECK(geom.is<mapnik::geometry::geometry_empty>());
+        }
+    }
+}
+
+TEST_CASE("mssql-simplify", "[decoder]") {
+
+    std::vector<geometry_simplify::algorithm> algorithms = {
+        geometry_simplify::SNAP,
+        geometry_simplify::DOUGLAS_PEUCKER,
+        geometry_simplify::VISVALINGAM
+    };
+
+    SECTION("rings keep at least 4 points")
+    {
+        for (auto algo : algorithms)
+        {
+            for (double tolerance : { 0.5, 5.0, 1e9 })
+            {
+                INFO(int(algo) << " " << tolerance);
+                geometry_simplify::simplifier simplifier(algo, tolerance);
+                auto ring = make_ring({ { 0, 0 }, { 1, 0.1 }, { 2, 0 }, { 2, 2 }, { 1, 2.1 }, { 0, 2 }, { 0, 0 } });
+                simplifier.apply(ring, true);
+                ring_check_visitor::check_ring(ring);
+                if (tolerance > 1)
+                {
+                    // collapsed to a triangle, not to a line
+                    REQUIRE(ring.size() == 4);
+                    double area = (ring[1].x - ring[0].x) * (ring[2].y - ring[0].y) -
+                                  (ring[2].x - ring[0].x) * (ring[1].y - ring[0].y);
+                    CHECK(area > 0);
+                }
+
+                auto line = make_line({ { 0, 0 }, { 1, 0.1 }, { 2, 0 }, { 3, 0.1 }, { 4, 0 } });
+                simplifier.apply(line, false);
+                REQUIRE(line.size() >= 2);
+                if (algo != geometry_simplify::SNAP)
+                {
+                    CHECK(line.front().x == 0);
+                    CHECK(line.back().x == 4);
+                }
+            }
+        }
+    }
+
+    SECTION("decoded rings keep at least 4 points")
+    {
+        std::vector<corpus_entry> corpus = load_corpus();
+        for (auto algo : algorithms)
+        {
+            geometry_decode_options options;
+            options.simplify = algo;
+            options.simplify_tolerance = 1e9;
+            geometry_simplify::simplifier simplifier(algo, options.simplify_tolerance);
+            for (auto const& entry : corpus)
+            {
+                INFO(entry.name << " " << int(algo));
+                ring_check_visitor full;
+                geometry_type original = from_geoclr(entry.clr.data(), entry.clr.size(), entry.is_geography);
+                mapnik::util::apply_visitor(full, original);
+
+                ring_check_visitor simplified;
+                geometry_type geom = from_geoclr(entry.clr.data(), entry.clr.size(), entry.is_geography, options, &simplifier);
+                mapnik::util::apply_visitor(simplified, geom);
+                if (full.ring_vertices > 0)
+                {
+                    CHECK(simplified.ring_vertices < full.ring_vertices);
+                }
+            }
+        }
+    }
+
+    SECTION("simplification drops vertices")
+    {
+        auto ring = make_ring({ { 0, 0 }, { 1, 0.01 }, { 2, 0 }, { 2, 2 }, { 1, 2.01 }, { 0, 2 }, { 0, 0 } });
+        geometry_simplify::simplifier simplifier(geometry_simplify::DOUGLAS_PEUCKER, 0.1);
+        simplifier.apply(ring, true);
+        CHECK(ring.size() < 7);
+        ring_check_visitor::check_ring(ring);
+    }
+}
+
+TEST_CASE("mssql-intern-cache", "[decoder]") {
+
+    int builds = 0;
+    auto builder = [&builds](std::string const& s) {
+        return [&builds, s]() {
+            ++builds;
+            return mapnik::value_unicode_string(UnicodeString::fromUTF8(StringPiece(s)));
+        };
+    };
+    auto get = [&builder](intern_cache& cache, std::string const& s) -> mapnik::value_unicode_string const& {
+        return cache.get(s.data(), s.size(), builder(s));
+    };
+
+    SECTION("repeated values are built once")
+    {
+        intern_cache cache(4);
+        mapnik::value_unicode_string const& a = get(cache, "a");
+        CHECK(&get(cache, "a") == &a);
+        CHECK(builds == 1);
+        CHECK(get(cache, "") == UnicodeString());
+        CHECK(get(cache, "") == UnicodeString());
+        CHECK(builds == 2);
+        CHECK(cache.size() == 2);
+    }
+
+    SECTION("stops growing at max_entries")
+    {
+        intern_cache cache(2);
+        get(cache, "a");
+        get(cache, "b");
+        CHECK(builds == 2);
+
+        // beyond the limit values are still right but built every time
+        CHECK(get(cache, "c") == UnicodeString::fromUTF8(StringPiece("c")));
+        CHECK(get(cache, "d") == UnicodeString::fromUTF8(StringPiece("d")));
+        CHECK(get(cache, "c") == UnicodeString::fromUTF8(StringPiece("c")));
+        CHECK(builds == 5);
+        CHECK(cache.size() == 2);
+
+        // the values cached first are kept
+        CHECK(get(cache, "a") == UnicodeString::fromUTF8(StringPiece("a")));
+        CHECK(get(cache, "b") == UnicodeString::fromUTF8(StringPiece("b")));
+        CHECK(builds == 5);
+    }
+
+    SECTION("a disabled cache builds every value")
+    {
+        intern_cache cache(0);
+        get(cache, "a");
+        get(cache, "a");
+        CHECK(builds == 2);
+        CHECK(cache.size() == 0);
+    }
+}